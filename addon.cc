@@ -5,14 +5,11 @@
 namespace gifencoder
 {
 
-using v8::Local;
-using v8::Object;
-
-void InitAll(Local<Object> exports, Local<Object> module)
+// Context aware so the addon can be loaded from worker_threads, every
+// context gets its own constructor and addon data.
+NODE_MODULE_INIT(/* exports, module, context */)
 {
-  NodeWrapper::Init(exports, module);
+  NodeWrapper::Init(exports, module, context);
 }
 
-NODE_MODULE(NODE_GYP_MODULE_NAME, InitAll)
-
 } // namespace gifencoder
\ No newline at end of file
@@ -0,0 +1,381 @@
+// Benchmark harness for the native encoder.
+//
+//   node bench/benchmark.js [options]   (npm run bench -- [options])
+//
+//   --addon <path>      addon to load (default build/Release, then build/Debug)
+//   --quick             small matrix, for a smoke run
+//   --soak <frames>     frames of the soak run (default 2000, 0 = skip)
+//   --threads <n>       concurrent encoders in worker threads (default 4)
+//   --out <file>        write results as JSON (default benchmark.json)
+//   --compare <file>    compare with an earlier JSON result, exit 1 on a
+//                       regression larger than --threshold (default 0.1)
+//   --no-js             skip the `gifencoder` JS baseline
+//
+// Run node with --expose-gc to collect finished encoders between
+// scenarios, so every peak RSS starts from the same baseline.
+const fs = require("fs");
+const os = require("os");
+const path = require("path");
+const { Worker, isMainThread, parentPort, workerData } = require("worker_threads");
+
+const args = parseArgs(process.argv.slice(2));
+const GIFEncoder = require(findAddon(args.addon));
+
+if (!isMainThread) {
+  // concurrent scenario: run one encoder and report back
+  const result = runScenario(workerData.scenario, makeFrames(workerData.scenario));
+  parentPort.postMessage(result);
+} else {
+  main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+  });
+}
+
+async function main() {
+  const results = [];
+  const record = (result) => {
+    results.push(result);
+    printResult(result);
+    if (global.gc) global.gc();
+  };
+
+  // synthetic input across resolutions, frame counts and quality levels
+  const sizes = args.quick ? [[320, 240], [1280, 720]] : [[320, 240], [1280, 720], [1920, 1080]];
+  const qualities = args.quick ? [10] : [1, 10, 20];
+  for (const [width, height] of sizes) {
+    for (const quality of qualities) {
+      const frames = width * height > 1e6 ? 10 : 30;
+      const scenario = { name: `synthetic-${width}x${height}-q${quality}`, width, height, frames, quality };
+      record(runScenario(scenario, makeFrames(scenario)));
+    }
+  }
+
+  // encoder options on the 720p input
+  for (const [name, setup] of [
+    ["histogram", { histogram: true }],
+    ["lossy80", { lossy: 80 }],
+    ["global", { globalPalette: 10 }],
+    ["warm", { warm: true }],
+  ]) {
+    const scenario = { name: `synthetic-1280x720-${name}`, width: 1280, height: 720, frames: 30, quality: 10, ...setup };
+    record(runScenario(scenario, makeFrames(scenario)));
+  }
+
+  // corpus: the example GIF re-encoded through the native decoder
+  const corpus = corpusFrames();
+  if (corpus) {
+    record(runScenario({ name: "corpus-example-gif", width: corpus.width, height: corpus.height, frames: corpus.frames.length, quality: 10 }, corpus.frames));
+  }
+
+  // concurrent encoders
+  const threads = args.threads;
+  if (threads > 1) {
+    const scenario = { name: `concurrent-${threads}x-1280x720`, width: 1280, height: 720, frames: args.quick ? 10 : 30, quality: 10 };
+    record(await runConcurrent(scenario, threads));
+  }
+
+  // JS baseline
+  if (!args.noJs) {
+    const baseline = jsBaseline({ name: "js-baseline-320x240-q10", width: 320, height: 240, frames: 30, quality: 10 });
+    if (baseline) record(baseline);
+  }
+
+  // soak: long run for steady-state memory and leaks
+  if (args.soak > 0) {
+    record(runSoak({ name: `soak-640x480-${args.soak}`, width: 640, height: 480, frames: args.soak, quality: 10 }));
+  }
+
+  const report = {
+    meta: {
+      date: new Date().toISOString(),
+      node: process.version,
+      platform: `${os.platform()} ${os.arch()}`,
+      cpu: os.cpus()[0] ? os.cpus()[0].model : "unknown",
+      cpus: os.cpus().length,
+    },
+    results,
+  };
+  fs.writeFileSync(args.out, JSON.stringify(report, null, 2));
+  console.log(`results written to ${args.out}`);
+
+  if (args.compare) {
+    const regressions = compare(JSON.parse(fs.readFileSync(args.compare, "utf8")), report, args.threshold);
+    if (regressions > 0) process.exit(1);
+  }
+}
+
+// Encodes scenario.frames frames cycling through frames, measuring each addFrame
+function runScenario(scenario, frames) {
+  const encoder = new GIFEncoder(scenario.width, scenario.height);
+  encoder.start();
+  encoder.setRepeat(0);
+  encoder.setQuality(scenario.quality);
+  encoder.setFrameRate(10);
+  if (scenario.histogram) encoder.setHistogramQuantizer(true);
+  if (scenario.lossy) encoder.setLossy(scenario.lossy);
+  if (scenario.globalPalette) encoder.setGlobalPalette(scenario.globalPalette);
+  if (scenario.warm) encoder.setWarmStart(true);
+
+  const latencies = [];
+  let peakRss = process.memoryUsage().rss;
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < scenario.frames; i++) {
+    const t = process.hrtime.bigint();
+    encoder.addFrame(frames[i % frames.length]);
+    latencies.push(Number(process.hrtime.bigint() - t) / 1e6);
+    peakRss = Math.max(peakRss, process.memoryUsage().rss);
+  }
+  const out = encoder.finish();
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+
+  return {
+    name: scenario.name,
+    width: scenario.width,
+    height: scenario.height,
+    frames: scenario.frames,
+    fps: scenario.frames / seconds,
+    p50Ms: percentile(latencies, 0.5),
+    p99Ms: percentile(latencies, 0.99),
+    bytes: out.length,
+    peakRssMb: peakRss / 1e6,
+  };
+}
+
+async function runConcurrent(scenario, threads) {
+  const start = process.hrtime.bigint();
+  const runs = await Promise.all(
+    Array.from({ length: threads }, () =>
+      new Promise((resolve, reject) => {
+        const worker = new Worker(__filename, { argv: process.argv.slice(2), workerData: { scenario } });
+        worker.once("message", resolve);
+        worker.once("error", reject);
+      })
+    )
+  );
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+
+  return {
+    name: scenario.name,
+    width: scenario.width,
+    height: scenario.height,
+    frames: scenario.frames * threads,
+    fps: (scenario.frames * threads) / seconds,
+    p50Ms: percentile(runs.map((r) => r.p50Ms), 0.5),
+    p99Ms: Math.max(...runs.map((r) => r.p99Ms)),
+    bytes: runs.reduce((sum, r) => sum + r.bytes, 0),
+    peakRssMb: process.memoryUsage().rss / 1e6,
+  };
+}
+
+// Long run sampling RSS, steady state is the median of the second half
+function runSoak(scenario) {
+  const frames = makeFrames({ ...scenario, frames: 16 });
+  const encoder = new GIFEncoder(scenario.width, scenario.height);
+  encoder.setOutput(path.join(os.tmpdir(), `gif-soak-${process.pid}.gif`));
+  encoder.start();
+  encoder.setRepeat(0);
+  encoder.setQuality(scenario.quality);
+
+  const samples = [];
+  const latencies = [];
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < scenario.frames; i++) {
+    const t = process.hrtime.bigint();
+    encoder.addFrame(frames[i % frames.length]);
+    latencies.push(Number(process.hrtime.bigint() - t) / 1e6);
+    if (i % 50 === 0) samples.push({ frame: i, rss: process.memoryUsage().rss / 1e6 });
+  }
+  const bytes = encoder.finish();
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+  fs.unlinkSync(path.join(os.tmpdir(), `gif-soak-${process.pid}.gif`));
+
+  const secondHalf = samples.slice(Math.floor(samples.length / 2));
+  return {
+    name: scenario.name,
+    width: scenario.width,
+    height: scenario.height,
+    frames: scenario.frames,
+    fps: scenario.frames / seconds,
+    p50Ms: percentile(latencies, 0.5),
+    p99Ms: percentile(latencies, 0.99),
+    bytes,
+    peakRssMb: Math.max(...samples.map((s) => s.rss)),
+    steadyRssMb: percentile(secondHalf.map((s) => s.rss), 0.5),
+    // growth over the second half, a leak shows up as a positive slope
+    rssMbPer1000Frames: slope(secondHalf.map((s) => [s.frame, s.rss])) * 1000,
+  };
+}
+
+// Same scenario through the `gifencoder` package, if it is installed
+function jsBaseline(scenario) {
+  let GIFEncoderJS;
+  try {
+    GIFEncoderJS = require("gifencoder");
+  } catch (err) {
+    console.log("gifencoder not installed, skipping the JS baseline");
+    return null;
+  }
+
+  const frames = makeFrames(scenario);
+  const encoder = new GIFEncoderJS(scenario.width, scenario.height);
+  encoder.start();
+  encoder.setRepeat(0);
+  encoder.setQuality(scenario.quality);
+  encoder.setFrameRate(10);
+
+  const latencies = [];
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < scenario.frames; i++) {
+    const t = process.hrtime.bigint();
+    encoder.addFrame(frames[i % frames.length]);
+    latencies.push(Number(process.hrtime.bigint() - t) / 1e6);
+  }
+  encoder.finish();
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+
+  return {
+    name: scenario.name,
+    width: scenario.width,
+    height: scenario.height,
+    frames: scenario.frames,
+    fps: scenario.frames / seconds,
+    p50Ms: percentile(latencies, 0.5),
+    p99Ms: percentile(latencies, 0.99),
+    bytes: encoder.out.getData().length,
+    peakRssMb: process.memoryUsage().rss / 1e6,
+  };
+}
+
+// Prints regressions of b against a, returns how many there are
+function compare(a, b, threshold) {
+  const before = new Map(a.results.map((r) => [r.name, r]));
+  // higher is better for fps, lower for everything else
+  const metrics = [
+    ["fps", -1],
+    ["p50Ms", 1],
+    ["p99Ms", 1],
+    ["bytes", 1],
+    ["peakRssMb", 1],
+    ["steadyRssMb", 1],
+  ];
+
+  let regressions = 0;
+  console.log(`\ncomparison with ${a.meta.date} (threshold ${threshold * 100}%)`);
+  for (const r of b.results) {
+    const old = before.get(r.name);
+    if (!old) continue;
+    const changes = [];
+    for (const [metric, sign] of metrics) {
+      if (old[metric] === undefined || r[metric] === undefined || old[metric] === 0) continue;
+      const change = (r[metric] - old[metric]) / old[metric];
+      if (change * sign > threshold) {
+        changes.push(`${metric} ${fmt(old[metric])} -> ${fmt(r[metric])} (${(change * 100).toFixed(1)}%)`);
+      }
+    }
+    // a leak that appeared is a regression whatever the relative change
+    if (r.rssMbPer1000Frames > 1 && !(old.rssMbPer1000Frames > 1)) {
+      changes.push(`rss grows ${fmt(r.rssMbPer1000Frames)} MB per 1000 frames`);
+    }
+    if (changes.length > 0) {
+      regressions++;
+      console.log(`REGRESSION ${r.name}: ${changes.join(", ")}`);
+    }
+  }
+  console.log(regressions === 0 ? "no regressions" : `${regressions} scenario(s) regressed`);
+  return regressions;
+}
+
+// Moving shapes over a gradient with a little noise, so frames differ
+function makeFrames(scenario) {
+  const { width, height } = scenario;
+  const count = Math.min(scenario.frames, 16);
+  const frames = [];
+  let seed = 1;
+  const random = () => (seed = (seed * 1103515245 + 12345) & 0x7fffffff) / 0x7fffffff;
+
+  for (let f = 0; f < count; f++) {
+    const data = Buffer.alloc(width * height * 4);
+    const cx = (width * (0.2 + 0.6 * (f / count))) | 0;
+    const cy = (height / 2) | 0;
+    const radius = Math.min(width, height) / 4;
+    for (let y = 0; y < height; y++) {
+      for (let x = 0; x < width; x++) {
+        const i = (y * width + x) * 4;
+        const inside = (x - cx) * (x - cx) + (y - cy) * (y - cy) < radius * radius;
+        const noise = (random() * 8) | 0;
+        data[i] = inside ? 230 : ((x * 255) / width + noise) | 0;
+        data[i + 1] = inside ? 60 + f * 8 : ((y * 255) / height + noise) | 0;
+        data[i + 2] = inside ? 40 : (128 + noise) | 0;
+        data[i + 3] = 255;
+      }
+    }
+    frames.push(data);
+  }
+  return frames;
+}
+
+// Frames of example/gif.gif, decoded natively
+function corpusFrames() {
+  const file = path.join(__dirname, "../example/gif.gif");
+  if (!fs.existsSync(file) || !GIFEncoder.Decoder) return null;
+
+  const decoder = new GIFEncoder.Decoder(fs.readFileSync(file));
+  const frames = [];
+  while (decoder.next()) frames.push(Buffer.from(decoder.canvas));
+  return { width: decoder.width, height: decoder.height, frames };
+}
+
+function percentile(values, p) {
+  if (values.length === 0) return 0;
+  const sorted = [...values].sort((x, y) => x - y);
+  return sorted[Math.min(sorted.length - 1, Math.floor(p * sorted.length))];
+}
+
+// least squares slope of [x, y] points
+function slope(points) {
+  if (points.length < 2) return 0;
+  const n = points.length;
+  const mx = points.reduce((s, [x]) => s + x, 0) / n;
+  const my = points.reduce((s, [, y]) => s + y, 0) / n;
+  const sxy = points.reduce((s, [x, y]) => s + (x - mx) * (y - my), 0);
+  const sxx = points.reduce((s, [x]) => s + (x - mx) * (x - mx), 0);
+  return sxx === 0 ? 0 : sxy / sxx;
+}
+
+function fmt(value) {
+  return Number.isInteger(value) ? String(value) : value.toFixed(2);
+}
+
+function printResult(r) {
+  const extra = r.steadyRssMb !== undefined ? ` steady ${fmt(r.steadyRssMb)}MB growth ${fmt(r.rssMbPer1000Frames)}MB/1000f` : "";
+  console.log(
+    `${r.name.padEnd(36)} ${fmt(r.fps).padStart(8)} fps  p50 ${fmt(r.p50Ms).padStart(8)}ms  p99 ${fmt(r.p99Ms).padStart(8)}ms  ${String(r.bytes).padStart(9)} bytes  rss ${fmt(r.peakRssMb)}MB${extra}`
+  );
+}
+
+function findAddon(explicit) {
+  const candidates = explicit
+    ? [path.resolve(explicit)]
+    : [path.join(__dirname, "../build/Release/addon.node"), path.join(__dirname, "../build/Debug/addon.node")];
+  const found = candidates.find((c) => fs.existsSync(c));
+  if (!found) throw new Error(`addon not found, build it first (tried ${candidates.join(", ")})`);
+  return found;
+}
+
+function parseArgs(argv) {
+  const options = { addon: null, quick: false, soak: 2000, threads: 4, out: "benchmark.json", compare: null, threshold: 0.1, noJs: false };
+  for (let i = 0; i < argv.length; i++) {
+    switch (argv[i]) {
+      case "--addon": options.addon = argv[++i]; break;
+      case "--quick": options.quick = true; options.soak = 300; options.threads = 2; break;
+      case "--soak": options.soak = Number(argv[++i]); break;
+      case "--threads": options.threads = Number(argv[++i]); break;
+      case "--out": options.out = argv[++i]; break;
+      case "--compare": options.compare = argv[++i]; break;
+      case "--threshold": options.threshold = Number(argv[++i]); break;
+      case "--no-js": options.noJs = true; break;
+    }
+  }
+  return options;
+}
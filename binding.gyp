@@ -8,7 +8,15 @@
         "src/gif-encoder.cpp",
         "src/typed-neu-quant.cpp",
         "src/lzw-encoder.cpp",
-        "src/byte-array.cpp"
+        "src/byte-array.cpp",
+        "src/pixel-format.cpp",
+        "src/palette-index.cpp",
+        "src/gif-decoder.cpp",
+        "src/decoder-wrapper.cpp",
+        "src/overlay.cpp",
+        "src/perf-counters.cpp",
+        "src/thread-pool.cpp",
+        "src/frame-cache.cpp"
       ],
       'libraries': ['-framework OpenGL', '-framework OpenCL'],
       "include_dirs": [
@@ -14,11 +14,33 @@ class ByteArray
 public:
   vector<unsigned char> data;
 
+  // Optional output target. With a file descriptor attached, data only
+  // buffers what has not been written yet and is handed to write() in
+  // chunks of at least flushSize bytes.
+  int fd = -1;
+  bool ownsFd = false;        // fd was opened by open() and is closed by close()
+  size_t flushSize = 1 << 20; // buffered bytes that trigger a write
+  size_t written = 0;         // bytes already written to fd
+  int error = 0;              // errno of the first failed open or write
+
   ByteArray();
   ~ByteArray();
 
   vector<unsigned char> &getData();
 
+  // Creates or truncates path and writes to it, false (with error set) on failure
+  bool open(const string &path);
+  // Opens an existing file, cuts it at offset and continues writing there
+  bool openAt(const string &path, size_t offset);
+  // Writes to an already open descriptor, which stays open after close()
+  void attach(int fileDescriptor);
+  // Total bytes produced, written or still buffered
+  size_t size() const;
+  // Writes the buffer out if it holds flushSize bytes, or always with force
+  bool flush(bool force = false);
+  // Writes what is left and closes an owned descriptor
+  bool close();
+
   void writeByte(int b);
 
   void writeByte(char b);
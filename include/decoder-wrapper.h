@@ -0,0 +1,29 @@
+#ifndef DECODERWRAPPER_H
+#define DECODERWRAPPER_H
+
+#include <node.h>
+#include <node_object_wrap.h>
+#include "gif-decoder.h"
+
+namespace gifencoder
+{
+class DecoderWrapper : public node::ObjectWrap
+{
+private:
+  GIFDecoder decoder;
+  bool canvasShared = false; // canvas set on the JS object
+
+public:
+  DecoderWrapper(const unsigned char *data, size_t length) : decoder(data, length)
+  {
+  }
+
+  // Adds the Decoder class to the encoder constructor as GIFEncoder.Decoder
+  static void Init(v8::Local<v8::Function> encoder, v8::Local<v8::Context> context);
+
+  static void New(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void Next(const v8::FunctionCallbackInfo<v8::Value> &args);
+};
+} // namespace gifencoder
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include "array"
+#include "cstdint"
+#include "list"
+#include "memory"
+#include "mutex"
+#include "unordered_map"
+#include "vector"
+
+namespace gifencoder
+{
+
+// SipHash of a frame's pixels and the options it was encoded with
+struct FrameKey
+{
+  uint64_t hash[2] = {0, 0};
+
+  bool operator==(const FrameKey &other) const
+  {
+    return hash[0] == other.hash[0] && hash[1] == other.hash[1];
+  }
+};
+
+/*
+  SipHash-2-4 with 128 bit output over everything passed to update(),
+  keyed with random bytes once per process. Unlike a plain multiply-xor
+  hash it gives independent 128 bit keys, so two frames sharing a cache
+  entry by accident is not a practical concern.
+*/
+class FrameHasher
+{
+public:
+  FrameHasher();
+  FrameHasher(uint64_t k0, uint64_t k1); // a fixed key instead
+  void update(const void *data, size_t length);
+  FrameKey finish();
+
+private:
+  uint64_t v[4];
+  uint64_t tail = 0; // bytes not yet making up a word
+  int tailBytes = 0;
+  uint64_t length = 0;
+
+  void compress(uint64_t word);
+};
+
+// What encoding a frame produced, see FrameCache
+struct CachedFrame
+{
+  std::array<unsigned char, 256 * 3> palette; // trained RGB table
+  unsigned char transIndex = 0;
+  std::vector<unsigned char> data; // LZW image data, empty if not kept
+};
+
+struct FrameCacheStats
+{
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;    // held by the entries
+  size_t capacity = 0; // 0 = disabled
+};
+
+/*
+  Process wide LRU cache of encoded frames, shared by every encoder that
+  enables it with setFrameCache. An entry keeps the palette trained for
+  a frame and its finished LZW image data, so a frame seen before, in
+  this GIF or another, skips training, mapping and compression. Entries
+  are evicted least recently used first once their bytes exceed the
+  capacity. Safe to use from several threads.
+*/
+class FrameCache
+{
+public:
+  static FrameCache &shared();
+
+  // Evicts down to bytes right away, 0 empties and disables the cache
+  void setCapacity(size_t bytes);
+  // The entry of key, counted as a hit or a miss, null if there is none
+  std::shared_ptr<const CachedFrame> find(const FrameKey &key);
+  // Adds or replaces the entry of key, unless it is larger than the cache
+  void insert(const FrameKey &key, std::shared_ptr<const CachedFrame> frame);
+  void clear();
+  FrameCacheStats statistics();
+
+  static const size_t defaultCapacity = 64 << 20;
+
+private:
+  struct KeyHash
+  {
+    size_t operator()(const FrameKey &key) const { return size_t(key.hash[0]); }
+  };
+  typedef std::pair<FrameKey, std::shared_ptr<const CachedFrame>> Entry;
+
+  std::mutex lock;
+  std::list<Entry> entries; // most recently used first
+  std::unordered_map<FrameKey, std::list<Entry>::iterator, KeyHash> byKey;
+  FrameCacheStats counts;
+
+  FrameCache();
+
+  static size_t entryBytes(const CachedFrame &frame);
+  void evict(size_t limit); // drops entries until bytes <= limit
+};
+
+} // namespace gifencoder
+
+#endif
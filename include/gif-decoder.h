@@ -0,0 +1,100 @@
+#ifndef GIFDECODER_H
+#define GIFDECODER_H
+
+#include "array"
+#include "memory"
+#include "string"
+#include "vector"
+
+namespace gifencoder
+{
+
+/*
+  Decodes a GIF frame by frame onto an RGBA canvas of the logical screen
+  size, applying the disposal method of the previous frame first. The
+  canvas always holds the fully composited picture, ready to be passed
+  to GIFEncoder::addFrame as PIXEL_RGBA. A frame reaching outside the
+  logical screen is treated as malformed. The canvas is only allocated
+  by the first next(), which fails for a screen larger than
+  maxScreenPixels; reading the header and findTrailer allocate nothing.
+*/
+class GIFDecoder
+{
+public:
+  // Placement and timing of the frame decoded last
+  struct Frame
+  {
+    int index = -1;
+    int x = 0, y = 0, width = 0, height = 0;
+    int delay = 0;             // hundredths of a second
+    int disposal = 0;          // 0 - 3, see the GIF89a spec
+    int transparentIndex = -1; // -1 = none
+    bool interlaced = false;
+  };
+
+  int width = 0, height = 0; // logical screen
+  int repeat = -1;           // Netscape loop count, -1 = no loop extension
+  Frame frame;
+
+  // RGBA canvas, shared so a JS buffer can keep it alive on its own.
+  // Null until next() decoded the first frame.
+  std::shared_ptr<std::vector<unsigned char>> canvas;
+
+  static const size_t maxScreenPixels = size_t(1) << 26; // 8192 x 8192
+
+  std::string error; // set when the data is malformed
+
+  // Copies data and reads the header, check error afterwards. Without
+  // copyData the data is only borrowed and has to outlive the decoder.
+  GIFDecoder(const unsigned char *data, size_t length, bool copyData = true);
+  GIFDecoder(std::vector<unsigned char> &&data);
+  GIFDecoder(const GIFDecoder &) = delete;
+  GIFDecoder &operator=(const GIFDecoder &) = delete;
+
+  // Global color table as r, g, b triples, globalColorCount() == 0 if none
+  const unsigned char *globalColors() const { return globalTab.data(); }
+  int globalColorCount() const { return globalSize; }
+
+  /*
+    Decodes the next frame onto the canvas. Returns false at the trailer
+    or on malformed data, in which case error is set.
+  */
+  bool next();
+
+  /*
+    Walks the remaining blocks without decoding them. Returns the offset of
+    the trailer (or of the end of data when it is missing) and counts the
+    frames passed, or returns 0 with error set on malformed data.
+  */
+  size_t findTrailer(int &frames);
+
+private:
+  std::vector<unsigned char> input; // owned copy of the data, unless borrowed
+  const unsigned char *data = nullptr;
+  size_t dataLength = 0;
+  size_t pos = 0;
+
+  std::array<unsigned char, 256 * 3> globalTab;
+  int globalSize = 0; // entries, 0 = no global table
+  std::array<unsigned char, 256 * 3> localTab;
+
+  std::vector<unsigned char> previous; // canvas before a disposal 3 frame
+  std::vector<unsigned char> indices;  // LZW output of the current frame
+  std::vector<unsigned char> blocks;   // joined image data sub-blocks
+  bool haveFrame = false;
+  bool done = false;
+
+  bool fail(const char *message);
+  bool readHeader();
+  bool allocateCanvas();
+  void readExtension(Frame &next);
+  bool skipBlocks();
+  bool readBlocks();
+  bool decodeIndices(int minCodeSize, size_t count);
+  void dispose();
+  void draw(const unsigned char *table, int tableSize);
+};
+
+} // namespace gifencoder
+
+#endif
@@ -2,9 +2,20 @@
 #define GIFENCODER_H
 
 #include <boost/optional.hpp>
-#include "map"
+#include "bitset"
+#include "cstdint"
+#include "memory"
+#include "vector"
 #include "byte-array.h"
+#include "pixel-format.h"
+#include "palette-index.h"
+#include "overlay.h"
+#include "gif-decoder.h"
+#include "perf-counters.h"
+#include "thread-pool.h"
+#include "frame-cache.h"
 #include "array"
+#include "valarray"
 #include "boost/compute/container/vector.hpp"
 
 using namespace std;
@@ -12,11 +23,68 @@ using namespace std;
 namespace gifencoder
 {
 
+// Area of the logical screen an image covers
+struct FrameRect
+{
+  int x = 0, y = 0, width = 0, height = 0;
+};
+
+// Timings and settings of the last encoded frame
+struct FrameStats
+{
+  double unpackMs = 0; // getImagePixels and the overlay
+  double overlayMs = 0; // overlay blending, part of unpackMs
+  double learnMs = 0;  // palette training
+  double histogramMs = 0; // histogram pass, part of learnMs
+  double mapMs = 0;    // mapping pixels to the palette
+  double lzwMs = 0;    // LZW compression
+  double writeMs = 0;  // headers, extensions and palettes
+  double totalMs = 0;
+  double budgetMs = 0; // budget the frame was tuned for, 0 = none
+
+  // settings chosen for the frame
+  int sample = 10;
+  int cycles = 100;
+  int samples = 0; // training samples taken
+  bool histogram = false;
+  bool warm = false; // palette training continued from the previous frame
+  bool localPalette = false; // frame carries its own color table
+  double paletteError = 0;   // mean squared RGB error of the mapping
+  int lossy = 0;
+  bool deferReset = false;
+  bool duplicate = false; // merged into the previous frame's delay
+  bool cached = false;    // palette, and data unless optimized, from the frame cache
+  int candidates = 0;     // encodings compared by setOptimize
+  FrameRect rect;         // area written, the whole screen unless optimized
+
+  // per stage hardware counters, only filled with setPerfCounters
+  bool perf = false;
+  PerfSample counters[PERF_STAGES];
+
+  size_t bytes = 0; // encoded size of the frame
+};
+
+// Predicted cost of a frame, see GIFEncoder::estimate
+struct FrameEstimate
+{
+  double bytes = 0;      // encoded size with the frame's headers
+  double ms = 0;         // single thread CPU time of addFrame
+  double bytesError = 0; // relative error bound of bytes
+  double msError = 0;    // relative error bound of ms, a fixed heuristic
+  int sampledRows = 0;
+};
+
+class LZWEncoder;
+
 class GIFEncoder
 {
 
 public:
   char* image; // current frame
+  FrameDescriptor imageDesc; // layout of the current frame
+  FrameRect region;          // area of the screen it covers, see addFrameRegion
+  vector<char> alphaMask; // 1 for fully transparent pixels, empty if unused
+  Overlay overlay;        // blended into every frame, empty if unused
   void getImagePixels();
 
   int width, height;
@@ -34,26 +102,158 @@ public:
   unsigned int delay = 0;
 
   char* pixels;        // BGR int array from frame
-  int pixLen;
+  int pixLen;          // bytes of it, region.width * region.height * 3
   char* indexedPixels; // converted frame indexed to palette
+  size_t pixelCapacity; // pixels the two buffers above can hold
+  // largest width * height, which keeps byte counts like w * h * 4 in int
+  static const size_t maxPixels = size_t(1) << 28;
   int colorDepth = 8;         // number of bit planes
   static const int colorTabLen = 256 * 3;
   array<int, colorTabLen> colorTab;       // RGB palette
-  map<int, bool> usedEntry;   // active palette entries
+  bitset<256> usedEntry;      // palette entries used by the current frame
+  PaletteIndex paletteIndex;  // nearest colour search over colorTab
+  PaletteIndex usedIndex;     // the used entries only, see findClosest
+  array<int, colorTabLen> usedIndexTab; // colorTab usedIndex was built from
+  bitset<256> usedIndexMask;            // usedEntry it was built from
   int palSize = 7;            // color table size (bits-1)
   int dispose = -1;           // disposal code (-1 = use default)
   bool firstFrame = true;
   int sample = 10; // default sample interval for quantizer
+  int lossy = 0;   // lossy LZW level, 0 = lossless
+  bool histogramQuantizer = false; // train NeuQuant on a colour histogram
+  int quantizerThreads = 1;        // pool tasks building that histogram
+  bool warmStart = false;          // keep the trained network between frames
+  int keyframeInterval = 0;        // frames between cold trainings, 0 = never
+  int warmFrames = 0;              // frames trained warm since the last cold one
+  std::valarray<double> warmNetwork[3]; // biased network of the last frame
+  bool deferReset = false; // keep a full LZW table until the ratio drops
 
   bool started = false; // started encoding
 
+  // Frame optimization: each frame is written as the smallest of several
+  // encodings that all show the same picture once composited, see
+  // setOptimize. canvas holds what the screen shows after the last frame,
+  // before its disposal, so the next one can be diffed against it.
+  int optimizeLevel = 0;
+  vector<int> canvas;        // RGB per pixel, -1 = cleared to background
+  vector<int> frameColors;   // the same for the frame being written
+  bool haveCanvas = false;   // canvas matches the output written so far
+  FrameRect lastRect;        // area of the last frame
+  int lastDisposal = 0;      // disposal written for the last frame
+  array<int, colorTabLen> screenTab; // global color table as written
+  int screenColors = 256;    // its entries
+  PaletteIndex screenIndex;  // search over screenTab, empty if unknown
+  FrameRect frameRect;       // area of the frame being written
+  int frameDisposal = 0;     // its disposal method
+  bool frameTransparent = false; // transIndex is used without a transparent color
+
+  // Global palette mode: the first globalPaletteFrames frames are held back,
+  // one palette is trained on all of them and written as the global color
+  // table, and every frame is mapped against it. Frames whose mean squared
+  // error exceeds maxPaletteError get a local table of their own.
+  struct PendingFrame
+  {
+    vector<char> alphaMask;
+    unsigned int delay;
+    FrameRect region;
+  };
+  int globalPaletteFrames = 0; // 0 = a fresh palette for every frame
+  double maxPaletteError = 0;  // <= 0 = never fall back to a local table
+  vector<char> pendingPixels;  // RGB of the held back frames, one after the other
+  vector<PendingFrame> pendingFrames;
+  array<int, 256 * 3> globalTab; // RGB global palette
+  PaletteIndex globalIndex;      // search over globalTab, empty until trained
+  bool fixedPalette = false;     // globalTab comes from setPalette
+
+  // Deadline-aware encoding: when a budget is set every frame picks its
+  // quantizer settings from costs measured on previous frames.
+  double frameBudget = 0;  // ms per frame, 0 = none
+  double totalBudget = 0;  // ms for the whole GIF, 0 = none
+  int budgetFrames = 0;    // expected frame count for totalBudget
+  int frameCount = 0;
+  double spentMs = 0;
+  double learnCost = 0.002;     // ms per training sample
+  double histogramCost = 5e-6;  // ms per pixel of the histogram pass
+  double pixelCost = 1e-4;      // ms per pixel to unpack, map and write
+  double lzwCost = 5e-5;        // ms per pixel of LZW with lossy / adaptive reset
+  double plainLzwCost = 1e-5;   // ms per pixel of plain LZW
+  int histogramBins = 4096;     // occupied bins seen on the last frame
+  FrameStats stats;             // last frame
+  PerfCounters perf;            // per stage counters, see setPerfCounters
+  TaskGroup tasks;              // this encoder's work on the shared pool
+  static const int mapStripPixels = 1 << 17; // smallest frame part mapped as a task
+
+  // Duplicate frame elimination: a frame equal to the last encoded one is
+  // not encoded, its delay is added to the GCE of that frame instead. The
+  // last frame's bytes stay in out until the next distinct frame so the
+  // GCE can be patched even when writing to a file.
+  bool dropDuplicates = false;
+  int duplicateTolerance = 0; // max per channel difference, 0 = bit-exact
+  bool haveLastFrame = false;
+  vector<char> lastPixels;    // RGB of the last encoded frame
+  vector<char> lastAlphaMask;
+  size_t lastDelayPos = 0;    // offset in out of its GCE delay
+  unsigned int lastDelay = 0;
+
+  // Frame cache, see setFrameCache
+  bool useFrameCache = false;
+  size_t pixelDataPos = 0; // offset in out.data of the last whole frame's image data
+
   ByteArray out;
 
+  // Extra output sizes, each an encoder of its own fed by this one
+  vector<unique_ptr<GIFEncoder>> sizes;
+
+  // Frame being streamed by addFrameRows, null between frames
+  unique_ptr<LZWEncoder> rowEncoder;
+  int rowsDone = 0;         // rows of it compressed so far
+  size_t rowFrameStart = 0; // out.size() when it began
+
   explicit GIFEncoder(int w = 0, int h = 0);
+  GIFEncoder(const GIFEncoder &) = delete;
+  GIFEncoder &operator=(const GIFEncoder &) = delete;
   ~GIFEncoder();
 
   void start();
+  /*
+    Prepares the encoder for a new animation, optionally of a new size
+    (0 keeps the current one). Output, frame and palette state are
+    cleared while settings, the budget cost model and allocated buffers
+    are kept; frame buffers only grow when the new size needs more. An
+    unfinished file output is closed without its buffered bytes, and an
+    overlay is dropped when the size changes.
+  */
+  void reset(int w = 0, int h = 0);
+  /*
+    Writes the trailer. When writing to a file the remaining buffered
+    bytes are written and a file opened by setOutput is closed.
+  */
   void finish();
+  /*
+    Writes the GIF to the file at path (created or truncated) or to an open
+    file descriptor instead of keeping it in out. Encoded bytes are written
+    in large chunks as frames complete, so memory stays bounded by a few
+    frames however long the animation is. Returns false if path can't be
+    opened, with the reason in out.error.
+  */
+  bool setOutput(const string &path);
+  void setOutput(int fd);
+  /*
+    Continues an existing GIF of the encoder's size instead of start():
+    its bytes up to the trailer become the start of out, unchanged, and
+    addFrame appends after its last frame. With setGlobalPalette the
+    GIF's global color table is used for the new frames, a GIF without
+    one gets local tables. The encoder must be fresh: not started and
+    without frames. appendFile
+    finds the trailer through a read-only mapping of the file and writes
+    from there on, like setOutput, so earlier frames are neither read
+    into memory, copied nor rewritten. Both
+    return false with a reason in error if the GIF can't be continued.
+  */
+  bool append(const unsigned char *gif, size_t length, string &error);
+  bool appendFile(const string &path, string &error);
+  // Takes over the screen and palette state of gif, see append
+  bool resumeFrom(const GIFDecoder &gif, string &error);
   void setRepeat(int r);
   /*
     Sets quality of color quantization (conversion of images to the maximum 256
@@ -63,13 +263,245 @@ public:
     greater than 20 do not yield significant improvements in speed.
   */
   void setQuality(int q);
+  /*
+    Trains the quantizer on a reduced precision colour histogram of the
+    frame instead of on the raw pixels. Training time then depends on the
+    number of distinct colours rather than the resolution, which makes
+    large frames much cheaper. threads (default 1) splits the histogram
+    pass into that many tasks on the shared thread pool.
+  */
+  void setHistogramQuantizer(bool enable, int threads);
+  /*
+    Keeps the trained palette network between frames and starts the next
+    frame's training from it with a quarter of the cycles and a smaller
+    radius and learning rate. Cuts quantization time on video-like input
+    and reduces palette flicker. keyframeInterval forces a full training
+    every that many frames (0 = only the first frame), which lets the
+    palette recover from scene cuts.
+  */
+  void setWarmStart(bool enable, int keyframeInterval);
+  /*
+    Trains one palette on the first `frames` frames (which are held back
+    until then, or until finish) and uses it as the global color table for
+    the whole animation. Every frame is mapped against it; one whose mean
+    squared RGB error exceeds maxError gets its own local table instead
+    (maxError <= 0 never does). 0 frames restores a palette per frame.
+    Once the first frame is written no global table can be added, and
+    frames keep their own tables.
+  */
+  void setGlobalPalette(int frames, double maxError);
+  /*
+    Sets the lossy LZW level. 0 (the default) keeps the output lossless,
+    higher values let the compressor substitute perceptually close palette
+    colours to extend matches, trading quality for size. Values around 80
+    typically shrink photographic content by a third or more.
+  */
+  void setLossy(int level);
+  /*
+    With defer set a full LZW code table is kept in use, without adding
+    codes, for as long as it clearly beats rebuilding it, instead of being
+    cleared once all codes are used. Pays off on repeating content such as
+    tiles, patterns and flat areas after busy ones, see LZWEncoder.
+  */
+  void setDeferredClear(bool defer);
+  /*
+    Sets how hard every frame after the first is optimized, like
+    gifsicle's -O levels. Each level encodes the candidates in parallel
+    and keeps the smallest, all of which composite to the same picture.
+    1 tries only the rectangle that changed since the last frame and
+    trims local color tables to the entries used, 2 also replaces
+    unchanged pixels with a transparent index and, with a transparent
+    color, chooses whether the last frame is cleared or left in place
+    (disposal 2 or 1), 3 also tries the global color table in place of a
+    local one. 0 (the default) writes every frame whole. With a
+    transparent color frames keep covering the whole screen, as pixels
+    turning transparent can only be cleared by disposing a frame that
+    covered them.
+  */
+  void setOptimize(int level);
+  /*
+    Composites the w x h RGBA image rgba at x, y onto every following
+    frame before it is quantized, using mode. The image is copied, and
+    blending data is precomputed, so it can be released afterwards. A null
+    rgba removes the overlay.
+  */
+  void setOverlay(const unsigned char *rgba, int w, int h, int x, int y, BlendMode mode);
+  /*
+    Reads cycles, instructions, last level cache misses, branch misses and
+    CPU time around every stage of addFrame into stats.counters (Linux
+    perf_event_open, exclusive of the kernel). Returns whether any
+    counter could be opened; unavailable ones read -1. The counters see
+    only the calling thread, so while they are on the stages run there
+    instead of on the thread pool; a stage that still handed work to the
+    pool reads -1 throughout and its poolTasks says how many tasks.
+  */
+  bool setPerfCounters(bool enable);
+  // Starts a measured stage, see setPerfCounters
+  PerfSample beginStage() const;
+  // Adds the counts since start to the stage in stats
+  void endStage(PerfStage stage, const PerfSample &start);
+  /*
+    Merges frames that repeat the previous one into it by extending its
+    delay instead of encoding them again. tolerance is the largest per
+    channel difference still counted as equal, 0 requires identical pixels.
+  */
+  void setDuplicateFrames(bool enable, int tolerance);
+  /*
+    Looks every frame up in the frame cache shared by all encoders of the
+    process (see FrameCache) before encoding it, and adds it there after.
+    A frame with the same pixels, size and quantizer, lossy and
+    transparency settings as a cached one reuses its palette and, when not
+    optimized, its LZW data, costing a hash and a copy. Frames mapped to a
+    global palette and warm started training are never cached, as their
+    palette depends on other frames.
+  */
+  void setFrameCache(bool enable);
+  // Hash of the current frame and the settings its encoding depends on
+  FrameKey frameKey() const;
+  // Writes the current frame from a cache entry of it
+  void encodeCached(const CachedFrame &frame);
+  // Adds the delay of the frame in pixels to the previous one if they match
+  bool mergeDuplicate();
+  // Patches the delay of the last written frame, false if it would overflow
+  bool extendLastDelay(unsigned int extra);
+  /*
+    Sets the scheduling class of this encoder's tasks on the thread pool
+    shared by all encoders, one of TaskPriority. Encoders of the same
+    priority take turns task by task, higher ones are served first.
+  */
+  void setPriority(int priority);
+  /*
+    Also produces the animation at w x h. Every frame is area-scaled from
+    the unpacked input to each size, one palette is trained on the
+    smallest of them and all sizes are mapped and LZW encoded with it in
+    parallel. The extra outputs are in sizes[i]->out after finish.
+    Frames are not held back for a global palette in this mode. Returns
+    false once the first frame has been written or held back.
+  */
+  bool addOutputSize(int w, int h);
+  // Encodes the current frame at every size, see addOutputSize
+  void encodeSizes();
+  // Maps and writes the current frame with a palette trained elsewhere
+  void encodeWithPalette(const array<int, colorTabLen> &tab, const PaletteIndex &index);
+  /*
+    Sets a time budget in milliseconds, either per frame or for a whole
+    GIF of the given number of frames (whichever is tighter when both are
+    set, 0 disables). Each frame then lowers the sampling quality, switches
+    to the histogram quantizer, shortens training or drops lossy and
+    adaptive LZW as needed to stay within the budget. The choice made is
+    reported in stats.
+  */
+  void setTimeBudget(double frameMs, double totalMs, int frames);
+  // Picks the settings of the next frame, see setTimeBudget
+  void tuneForBudget();
+  // Folds the timings of the frame just encoded into the cost model
+  void updateCosts();
   /*
     Sets frame rate in frames per second.
   */
   void setFrameRate(int fps);
-  void addFrame(char* frame);
+  /*
+    Adds a frame. desc declares the pixel format and row stride of frame,
+    by default it is tightly packed RGBA.
+  */
+  void addFrame(char* frame, const FrameDescriptor &desc = FrameDescriptor());
+  /*
+    Adds a frame that only changes rect of the screen, for producers that
+    already know what changed. frame points at the rect's first pixel and
+    its rows are desc's stride apart, so it can be the rect's own pixels
+    or lie inside a whole frame. Only the rect is quantized, mapped and
+    compressed, and it is written at its position, drawn over what the
+    last frame's disposal left (with a transparent color whole frames are
+    cleared unless dispose is set) and is left in place itself.
+    The frame is not diffed by setOptimize, nor merged as a duplicate.
+    Returns false with a reason in error for a rect outside the screen
+    and with extra output sizes.
+  */
+  bool addFrameRegion(char *frame, const FrameDescriptor &desc, const FrameRect &rect, string &error);
+  // The frame being added covers less than the whole screen
+  bool partialFrame() const { return region.width != width || region.height != height; }
+  /*
+    Uses the first `colors` r, g, b triples of rgb as the global color
+    table of the whole animation instead of training palettes, every frame
+    is mapped against it. Returns false after the first frame or for more
+    than 256 colors. 0 colors goes back to trained palettes.
+  */
+  bool setPalette(const unsigned char *rgb, int colors);
+  /*
+    Adds the next count rows of a frame laid out as desc says, so a frame
+    can be encoded while it is still being produced. The first call writes
+    the frame's headers, every call maps and LZW compresses its rows right
+    away and the call completing height rows ends the frame. Only the rows
+    of one call are held. Needs a palette known up front, from setPalette
+    or an already trained global palette. Streamed frames are not merged
+    as duplicates nor scaled to extra output sizes. Returns false with a
+    reason in error if the rows can't be added.
+  */
+  bool addFrameRows(char *rows, int count, const FrameDescriptor &desc, string &error);
+  // A frame of addFrameRows still misses rows
+  bool rowsPending() const { return rowEncoder != nullptr; }
+  /*
+    Adds a frame that is already palette indexed: width x height indices,
+    rows stride bytes apart (0 = width), into the `colors` r, g, b triples
+    of rgb. The palette becomes the frame's color table as it is, sized
+    to the next power of two, and the indices go straight to LZW with no
+    unpacking, training or mapping. A palette equal to the global color
+    table (the first frame's, or the global palette) is not repeated as
+    a local one. transparentIndex (-1 = none) is treated like the
+    transparent color: the frame is cleared by default, and its pixels
+    show what the last frame's disposal left. Returns false with a
+    reason in error, before anything is written or held back frames are
+    flushed, for indices outside the palette, a stride below width and
+    modes that need RGB input.
+  */
+  bool addIndexedFrame(const char *indices, int stride, const unsigned char *rgb, int colors, int transparentIndex, string &error);
+  /*
+    Predicts the size and encode time of frame without encoding it. Bands
+    of rows making up about `fraction` (clamped to 0 - 1) of the frame go
+    through the real pipeline with the current settings: a palette is
+    trained on them (unless a global one exists), they are mapped and LZW
+    compressed one after the other. The other rows are extrapolated from the bands
+    after the first, which pays the dictionary warm-up. first adds the
+    file header, screen descriptor, global table and loop extension.
+    The encoder's state is not changed.
+  */
+  FrameEstimate estimate(char *frame, const FrameDescriptor &desc, double fraction, bool first);
+  static const int estimateBandRows = 4;
+  static const int estimateMinBands = 16;
+  static constexpr double estimateBiasError = 0.1; // see estimate()
+  // A fixed heuristic, not derived from the sample: most measured frames
+  // land within it, but scheduling and cache noise can exceed it
+  static constexpr double estimateTimeError = 0.35;
   void writePixels();
   void analyzePixels();
+  // Calls function(i) for i in [0, count) on the thread pool, or on this
+  // thread while perf counters are on, which see only this thread
+  void runParallel(int count, const function<void(int)> &function);
+  // Maps the first count pixels (all by default) to colorTab through
+  // index, returns the mean squared error if measureError is set
+  double mapPixels(const PaletteIndex &index, bool measureError, int count = -1);
+  // Quantizes, maps and writes the frame currently in pixels
+  void encodeFrame();
+  // Trains colorTab and paletteIndex on trainLen bytes of RGB
+  void trainPalette(char *trainPixels, int trainLen);
+  // Sets transIndex and gives fully transparent pixels that index
+  void applyTransparency();
+  // Writes the mapped frame: screen descriptor and global table when it
+  // is the first, then its extension, descriptor, local table and pixels,
+  // or pixelData in their place when it is given and not optimized
+  void writeFrame(const vector<unsigned char> *pixelData = nullptr);
+  // The part of writeFrame before the pixel data
+  void writeFrameHeader();
+  // Sets the next frame to cover region with the default disposal
+  void wholeFrame();
+  // Disposal of a frame when neither the caller nor setOptimize picked one
+  int defaultDisposal() const;
+  // Writes the mapped frame as the smallest candidate, see setOptimize
+  void writeSmallestFrame();
+  // Paints a partial frame just written onto the canvas, see setOptimize
+  void trackRegion();
+  // Trains the global palette on the held back frames and writes them
+  void flushPendingFrames();
   int findClosest(int c);
   void writeShort(int pValue);
   void writeLSD();
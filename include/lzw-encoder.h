@@ -31,6 +31,10 @@ namespace gifencoder
 {
 const int BITS = 12;
 const int HSIZE = 5003; // 80% occupancy
+const int LOSSY_CANDIDATES = 32; // palette neighbours tried per lossy match
+const int CHECK_GAP = 4096;       // pixels between compression ratio checks
+const double DEFER_GAIN = 1.5;    // a full table must beat its fill ratio by this
+const double DEFER_SLIP = 0.9;    // and keep this much of the previous window's
 
 class LZWEncoder
 {
@@ -60,9 +64,41 @@ public:
   // file size for noticeable speed improvement on small files. Please direct
   // questions about this implementation to ames!jaw.
   int g_init_bits, ClearCode, EOFCode;
-  int remaining;
-  int curPixel;
+  int curPixel; // pixels compressed so far
   int n_bits;
+  int ent;            // code of the string matched so far
+  bool haveEnt;       // ent holds a pixel, false before the first one
+  int hshift;         // hash code range bound
+
+  // Lossy compression (in the spirit of gifsicle --lossy): when the exact
+  // prefix + pixel string is not in the table, the match may continue with
+  // a palette colour that is perceptually close to the real pixel. 0 = off.
+  int lossy = 0;
+  const int *palette = nullptr; // RGB colour table the indices refer to
+  unsigned char neighbours[256][LOSSY_CANDIDATES];
+  int neighbourCount[256];
+  int transparentIndex = -1; // neither substituted nor used as a substitute
+  // when set, every substitution is written here at the pixel's position
+  // (counted from begin()), so it ends up holding what a decoder shows
+  char *decoded = nullptr;
+
+  // Deferred clear: with deferReset a full table stays in use (no new
+  // codes are added) instead of being cleared right away. Every CHECK_GAP
+  // pixels the ratio of pixels to output bits over the last window is
+  // checked, and the table is cleared once that ratio is below DEFER_GAIN
+  // times the ratio it had while being built, as a fresh table would do
+  // about as well, or below DEFER_SLIP times the previous window's, as the
+  // content has changed.
+  bool deferReset = false;
+  long out_bits = 0;   // bits written by output()
+  int checkpoint;      // pixel count of the next ratio check
+  int window_in;       // pixel count at the start of the window
+  long window_out;     // out_bits at the start of the window
+  int clear_in;        // pixel count at the last clear
+  long clear_out;      // out_bits at the last clear
+  double last_ratio;   // ratio of the previous window
+  double fill_ratio;   // overall ratio from the last clear until the table filled
+  bool ratio_drop;     // last check saw the ratio fall
 
   LZWEncoder(int width, int height, char* pixels, int colorDepth);
 
@@ -70,7 +106,13 @@ public:
 
   void encode(ByteArray &outs);
 
-  void compress(int init_bits, ByteArray &outs);
+  // encode() in steps, for pixels that arrive in parts: begin() writes
+  // the initial code size and first clear code, feed() compresses the
+  // next count indices in order and end() writes the rest of the image
+  // data. The pixels given to the constructor are not used.
+  void begin(ByteArray &outs);
+  void feed(const char *indices, int count, ByteArray &outs);
+  void end(ByteArray &outs);
 
   // Flush the packet to disk, and reset the accumulator
   void flush_char(ByteArray &outs);
@@ -88,8 +130,15 @@ public:
   // Reset code table
   void cl_hash(int hsize);
 
-  // Return the next pixel from the image
-  int nextPixel();
+  // Judges the compression ratio of the window ending at in_count, see
+  // deferReset
+  void check_ratio(int in_count);
+
+  // Find the code for prefix ent followed by pixel c, or -1
+  int lookup(int ent, int c, int hshift);
+
+  // Build the per-index list of acceptable substitutes for lossy matching
+  void buildNeighbours();
 
   void output(int code, ByteArray &outs);
 };
@@ -7,24 +7,60 @@
 
 namespace gifencoder
 {
+/*
+  Returns the bytes behind a Buffer, typed array, DataView, ArrayBuffer or
+  SharedArrayBuffer without copying them, or nullptr for anything else.
+*/
+char *FrameData(v8::Local<v8::Value> value, size_t &length);
+
 class NodeWrapper : public node::ObjectWrap
 {
 private:
   GIFEncoder encoder;
+  int64_t reportedBytes = 0; // frame buffers V8 was told about
+
+  // Tells V8 about the native frame buffers so collection keeps up with them
+  void ReportMemory(v8::Isolate *isolate);
 
 public:
-  NodeWrapper(int width, int height)
+  NodeWrapper(int width, int height) : encoder(width, height)
   {
-    encoder = GIFEncoder(width, height);
   }
+  ~NodeWrapper();
 
-  static void Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module);
+  static void Init(v8::Local<v8::Object> exports, v8::Local<v8::Value> module, v8::Local<v8::Context> context);
 
   static void New(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void Start(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void Reset(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void Finish(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetOutput(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetPriority(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetThreadPoolSize(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetFrameCacheSize(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void GetFrameCacheStats(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void Estimate(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void AddFrameRegion(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void AddFrameRows(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void AddIndexedFrame(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetPalette(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void AddOutputSize(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void GetOutput(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void Append(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void SetRepeat(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void SetQuality(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetHistogramQuantizer(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetWarmStart(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetGlobalPalette(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetLossy(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetDeferredClear(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetOptimize(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetPerfCounters(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetOverlay(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetDuplicateFrames(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetFrameCache(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void SetTimeBudget(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void GetFrameStats(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void SetFrameRate(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void AddFrame(const v8::FunctionCallbackInfo<v8::Value> &args);
 };
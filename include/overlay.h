@@ -0,0 +1,60 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "climits"
+#include "vector"
+
+namespace gifencoder
+{
+
+// How an overlay is combined with the frame below it
+enum BlendMode
+{
+  BLEND_OVER = 0,
+  BLEND_MULTIPLY,
+  BLEND_SCREEN
+};
+
+// Parses a blend mode name ("over", "multiply", "screen"), returns false
+// if the name is unknown
+bool parseBlendMode(const char *name, BlendMode &mode);
+
+/*
+  A static RGBA image composited onto every frame before quantization.
+
+  With premultiplied overlay colour P and alpha A, all three modes reduce
+  to out = add + frame * mul / 255 per channel (over: mul = 255 - A,
+  add = P; multiply: mul = 255 - A + P, add = 0; screen: mul = 255 - P,
+  add = P). set() works those out once for the part of the overlay that
+  lies inside the frame, so blending a frame is one straight-line loop
+  per row that the compiler can vectorize.
+*/
+class Overlay
+{
+public:
+  // Stores an rgba image of w x h at x, y (may be partly outside) for
+  // frames of frameWidth x frameHeight
+  void set(const unsigned char *rgba, int w, int h, int x, int y, BlendMode mode, int frameWidth, int frameHeight);
+  void clear();
+  bool empty() const { return width == 0 || height == 0; }
+
+  /*
+    Blends into the packed RGB frame in place. Pixels of alphaMask that the
+    overlay covers with any opacity in "over" mode become opaque. With
+    firstRow and rowCount, rgb and alphaMask hold only those frame rows,
+    with firstColumn their rows of frameWidth pixels start at that column.
+  */
+  void apply(char *rgb, int frameWidth, std::vector<char> &alphaMask, int firstRow = 0, int rowCount = INT_MAX,
+             int firstColumn = 0) const;
+
+private:
+  int left = 0, top = 0;      // clipped position in the frame
+  int width = 0, height = 0;  // clipped size
+  BlendMode mode = BLEND_OVER;
+  std::vector<unsigned char> mul, add; // per channel, width * 3 per row
+  std::vector<char> covers;            // alpha > 0, per pixel
+};
+
+} // namespace gifencoder
+
+#endif
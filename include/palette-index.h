@@ -0,0 +1,46 @@
+#ifndef PALETTEINDEX_H
+#define PALETTEINDEX_H
+
+#include "bitset"
+#include "vector"
+
+namespace gifencoder
+{
+
+/*
+  Nearest colour search over a palette of up to 256 RGB entries.
+
+  RGB space is split into a grid of 8x8x8 cells. For every cell build()
+  keeps only the entries that can be the nearest one (squared euclidean
+  distance) to some colour inside it: those whose distance to the cell
+  box is no larger than the smallest worst case distance of any entry.
+  A lookup then scans one short list instead of the whole palette.
+*/
+class PaletteIndex
+{
+public:
+  static const int cellBits = 3;
+  static const int cells = 1 << (cellBits * 3);
+
+  // palette is r, g, b triples, mask (if given) limits the usable entries
+  void build(const int *palette, int size, const std::bitset<256> *mask = nullptr);
+
+  // index of the entry nearest to r, g, b, -1 for an empty index
+  int lookup(int r, int g, int b) const;
+
+  bool empty() const { return entries.empty(); }
+  void clear();
+
+private:
+  struct Entry
+  {
+    int r, g, b, index;
+  };
+
+  std::vector<Entry> entries;
+  int cellStart[cells + 1] = {0}; // all 0 while empty, lookups scan nothing
+};
+
+} // namespace gifencoder
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include "cstdint"
+
+namespace gifencoder
+{
+
+// Encoding stages measured by PerfCounters
+enum PerfStage
+{
+  STAGE_UNPACK = 0, // getImagePixels and the overlay
+  STAGE_LEARN,      // palette training, inxbuild included
+  STAGE_INXBUILD,   // TypedNeuQuant::inxbuild alone
+  STAGE_MAP,        // mapping pixels to the palette
+  STAGE_LZW,        // LZW compression into out
+  STAGE_WRITE,      // headers, extensions and palettes
+  PERF_STAGES
+};
+
+// Counters read by PerfCounters
+enum PerfEvent
+{
+  EVENT_CYCLES = 0,
+  EVENT_INSTRUCTIONS,
+  EVENT_LLC_MISSES,
+  EVENT_BRANCH_MISSES,
+  EVENT_TASK_CLOCK, // ns of CPU time, a software event that works in VMs
+  PERF_EVENTS
+};
+
+// Names used in stats, indexed by PerfStage and PerfEvent
+extern const char *const perfStageNames[PERF_STAGES];
+extern const char *const perfEventNames[PERF_EVENTS];
+
+struct PerfSample
+{
+  int64_t value[PERF_EVENTS] = {0};
+  // Of a start sample, the tasks the thread had given the thread pool so
+  // far; of a stage total, the tasks the stage gave it. Stages run inline
+  // while counting, so this stays 0; counts that missed pool work read -1.
+  int64_t poolTasks = 0;
+};
+
+/*
+  Hardware counters of the calling thread through Linux perf_event_open,
+  scaled when the kernel multiplexes them. Thread pool workers are not
+  counted, see PerfSample::poolTasks. Events the machine or
+  perf_event_paranoid doesn't allow stay closed and read as -1.
+  Elsewhere than Linux nothing opens and every read is -1.
+*/
+class PerfCounters
+{
+public:
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // Opens the counters, true if at least one is available
+  bool open();
+  void close();
+  bool enabled() const { return isOpen; }
+
+  // Current counts, -1 for unavailable events
+  PerfSample read() const;
+  // Adds the counts since start to total
+  void addSince(const PerfSample &start, PerfSample &total) const;
+
+private:
+  int fds[PERF_EVENTS];
+  bool isOpen = false;
+};
+
+} // namespace gifencoder
+
+#endif
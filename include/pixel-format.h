@@ -0,0 +1,66 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+namespace gifencoder
+{
+
+// Channel layouts accepted by addFrame
+enum PixelFormat
+{
+  PIXEL_RGBA = 0,
+  PIXEL_RGB,
+  PIXEL_BGRA,
+  PIXEL_ARGB,
+  PIXEL_GRAY
+};
+
+// Describes how an incoming frame is laid out in memory
+struct FrameDescriptor
+{
+  PixelFormat format = PIXEL_RGBA;
+  int stride = 0; // bytes per row, 0 = tightly packed
+
+  int bytesPerPixel() const;
+  int alphaOffset() const; // -1 when the format has no alpha channel
+  int rowStride(int width) const;
+};
+
+// Parses a format name ("rgba", "rgb", "bgra", "argb", "gray"), returns
+// false if the name is unknown
+bool parsePixelFormat(const char *name, PixelFormat &format);
+
+/*
+  Copies a width x height frame into packed RGB. The channel offsets are
+  template parameters so every format gets its own straight-line inner
+  loop that the compiler can vectorize.
+*/
+template <int BPP, int R, int G, int B>
+void unpackPixels(const char *src, int stride, int width, int height, char *dst)
+{
+  for (int i = 0; i < height; i++)
+  {
+    const char *row = src + (long)i * stride;
+    char *out = dst + (long)i * width * 3;
+    for (int j = 0; j < width; j++)
+    {
+      out[j * 3] = row[j * BPP + R];
+      out[j * 3 + 1] = row[j * BPP + G];
+      out[j * 3 + 2] = row[j * BPP + B];
+    }
+  }
+}
+
+// Unpacks a frame of any supported format into packed RGB
+void unpackPixels(const char *src, const FrameDescriptor &desc, int width, int height, char *dst);
+
+/*
+  Resamples packed RGB with an area filter: every output pixel is the
+  average of the source area it covers, partly covered source pixels
+  weighted by their share. Rows are filtered horizontally into floats and
+  then summed with straight-line loops the compiler can vectorize.
+*/
+void scalePixels(const char *src, int srcWidth, int srcHeight, char *dst, int dstWidth, int dstHeight);
+
+} // namespace gifencoder
+
+#endif
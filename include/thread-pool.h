@@ -0,0 +1,149 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "atomic"
+#include "condition_variable"
+#include "cstdint"
+#include "deque"
+#include "exception"
+#include "functional"
+#include "mutex"
+#include "thread"
+
+namespace gifencoder
+{
+
+class TaskGroup;
+
+// Scheduling classes of a TaskGroup, higher runs first
+enum TaskPriority
+{
+  PRIORITY_LOW = 0,
+  PRIORITY_NORMAL,
+  PRIORITY_HIGH,
+  PRIORITIES
+};
+
+/*
+  Process wide pool of worker threads shared by every encoder, so many
+  encoders in one process don't each start threads of their own.
+
+  Tasks submitted from outside the pool queue up per TaskGroup (one per
+  encoder). Workers take them from the highest priority with queued work
+  and round robin between the groups of that priority, so one large
+  animation can't hold back the frames of the others. Tasks submitted
+  from inside a task go to the worker's own deque, which it pops from
+  the back; idle workers steal from the front of the others.
+*/
+class ThreadPool
+{
+public:
+  static ThreadPool &shared();
+
+  // Worker threads, the threads waiting on a group help on top of these
+  int size() const { return threads; }
+  // Starts or stops workers, n < 1 picks one less than the hardware threads
+  void resize(int n);
+  // Tasks the calling thread has submitted so far, to any group
+  static int64_t submittedByThread();
+
+private:
+  friend class TaskGroup;
+
+  typedef std::function<void()> Function;
+  struct Task
+  {
+    Function function;
+    TaskGroup *group = nullptr;
+  };
+
+  struct Worker
+  {
+    std::mutex lock;
+    std::deque<Task> tasks;
+    std::thread thread;
+    bool stop = false;
+  };
+
+  static const int maxWorkers = 256;
+
+  // slots are never freed, so stealing needs no lock on the list
+  Worker workers[maxWorkers];
+  std::atomic<int> slots{0}; // slots ever started
+  int threads = 0;
+  std::mutex resizeLock;
+
+  // queued tasks of outside callers, see TaskGroup
+  std::mutex injectLock;
+  std::deque<TaskGroup *> ready[PRIORITIES];
+
+  std::atomic<int> queued{0};      // tasks not yet taken, anywhere
+  std::atomic<int> localQueued{0}; // of those, in worker deques
+  std::mutex sleepLock;
+  std::condition_variable workReady; // workers wait on this
+  std::condition_variable taskDone;  // TaskGroup::wait waits on this
+
+  ThreadPool() = default;
+
+  void submit(TaskGroup *group, Function function);
+  void run(Task &task);
+  bool popLocal(Worker *worker, Task &task);
+  bool popInjected(Task &task);
+  bool popGroup(TaskGroup *group, Task &task);
+  bool steal(Task &task);
+  void workerLoop(Worker *worker);
+  void notifyWorkers();
+  void notifyWaiters();
+};
+
+/*
+  The tasks of one encoder. wait() returns when all of them have run and
+  meanwhile runs the group's own queued tasks (and tasks it can steal)
+  on the calling thread, so a group progresses even when every worker is
+  busy elsewhere and nested waits can't deadlock.
+
+  A task that throws doesn't take its worker down: the first exception of
+  the group is kept and wait() rethrows it on the waiting thread once the
+  other tasks have finished.
+*/
+class TaskGroup
+{
+public:
+  TaskGroup() = default;
+  ~TaskGroup();
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  // Applies to tasks submitted afterwards
+  void setPriority(int p);
+  int priority() const { return level; }
+
+  void run(std::function<void()> function);
+  void wait();
+
+  /*
+    Calls function(i) for i in [0, count), index 0 on the calling thread
+    and the rest as tasks, and waits for all of them.
+  */
+  void parallel(int count, const std::function<void(int)> &function);
+
+private:
+  friend class ThreadPool;
+
+  // wait() without rethrowing
+  void drain();
+
+  int level = PRIORITY_NORMAL;
+  std::atomic<int> pending{0};
+  std::mutex errorLock;
+  std::exception_ptr error; // first exception a task threw, not yet rethrown
+  bool submitted = false; // run() was called, the pool may know the group
+
+  // guarded by ThreadPool::injectLock
+  std::deque<ThreadPool::Task> queue;
+  bool scheduled = false; // in a ThreadPool::ready list
+};
+
+} // namespace gifencoder
+
+#endif
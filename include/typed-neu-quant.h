@@ -3,6 +3,10 @@
 
 #include "boost/compute/container/vector.hpp"
 #include "valarray"
+#include "vector"
+#include "cstdint"
+#include "perf-counters.h"
+#include "thread-pool.h"
 
 namespace gifencoder
 {
@@ -63,6 +67,34 @@ public:
   double bias[netsize];
   double freq[netsize];
   double radpower[netsize >> 3];
+
+  // Histogram training: instead of stepping through the pixels, learn()
+  // first reduces the frame to a 5-6-5 colour histogram and then draws
+  // samples from it weighted by pixel count, so the cost is bounded by the
+  // number of distinct colours rather than the frame size.
+  static const int histogramBins = 1 << 16;
+  static const int histogramSamples = 4; // samples per occupied bin
+  bool useHistogram = false;
+  int threads = 1; // parts the histogram pass is split into
+  TaskGroup *tasks = nullptr; // runs those parts, inline when not set
+  std::vector<int> histColors;       // biased b, g, r mean of each occupied bin
+  std::vector<uint64_t> histWeights; // cumulative pixel counts
+  double histogramMs = 0;            // time spent in buildHistogram
+
+  int samples = 0; // training samples taken by the last learn()
+
+  // Warm start: when warmNetwork points at the biased b, g, r network of a
+  // previous frame, learn() continues from it for warmCycles cycles with
+  // the initial radius and alpha divided by 1 << warmShift. The network
+  // after learn() (before unbiasing) is kept in learned.
+  const std::valarray<double> *warmNetwork = nullptr;
+  int warmCycles = 25;
+  int warmShift = 2;
+  std::valarray<double> learned[3];
+
+  // When set and enabled, counts inxbuild into inxbuildCounters
+  const PerfCounters *perf = nullptr;
+  PerfSample inxbuildCounters;
   
   TypedNeuQuant(char*&, int, int);
 
@@ -74,6 +106,7 @@ public:
   void inxbuild();
   int inxsearch(int, int, int);
   void learn();
+  void buildHistogram();
 
   void buildColormap();
   void getColormap(std::array<int, netsize * 3> &map);
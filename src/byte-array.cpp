@@ -1,10 +1,100 @@
 #include "byte-array.h"
+#include "cerrno"
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace gifencoder
 {
 
 ByteArray::ByteArray(){};
-ByteArray::~ByteArray(){};
+ByteArray::~ByteArray()
+{
+  // an encoder dropped before finish still releases its file
+  if (ownsFd && fd >= 0)
+    ::close(fd);
+};
+
+bool ByteArray::open(const string &path)
+{
+  int f = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (f < 0)
+  {
+    error = errno;
+    return false;
+  }
+  attach(f);
+  ownsFd = true;
+  return true;
+}
+
+bool ByteArray::openAt(const string &path, size_t offset)
+{
+  int f = ::open(path.c_str(), O_WRONLY);
+  if (f < 0 || ftruncate(f, offset) != 0 || lseek(f, offset, SEEK_SET) < 0)
+  {
+    error = errno;
+    if (f >= 0)
+      ::close(f);
+    return false;
+  }
+  attach(f);
+  ownsFd = true;
+  written = offset;
+  return true;
+}
+
+void ByteArray::attach(int fileDescriptor)
+{
+  if (ownsFd && fd >= 0)
+    ::close(fd);
+  fd = fileDescriptor;
+  ownsFd = false;
+  written = 0;
+  error = 0;
+}
+
+size_t ByteArray::size() const
+{
+  return written + data.size();
+}
+
+bool ByteArray::flush(bool force)
+{
+  if (fd < 0 || error != 0)
+    return error == 0;
+  if (!force && data.size() < flushSize)
+    return true;
+
+  size_t done = 0;
+  while (done < data.size())
+  {
+    ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      error = errno;
+      break;
+    }
+    done += n;
+  }
+
+  written += done;
+  data.erase(data.begin(), data.begin() + done);
+  return error == 0;
+}
+
+bool ByteArray::close()
+{
+  if (fd < 0)
+    return true;
+  flush(true);
+  if (ownsFd && ::close(fd) != 0 && error == 0)
+    error = errno;
+  fd = -1;
+  ownsFd = false;
+  return error == 0;
+}
 
 vector<unsigned char>& ByteArray::getData()
 {
@@ -0,0 +1,151 @@
+#include "decoder-wrapper.h"
+#include "node-wrapper.h"
+#include "node_buffer.h"
+
+namespace gifencoder
+{
+using v8::ArrayBuffer;
+using v8::BackingStore;
+using v8::Context;
+using v8::Exception;
+using v8::Function;
+using v8::FunctionCallbackInfo;
+using v8::FunctionTemplate;
+using v8::Isolate;
+using v8::Local;
+using v8::NewStringType;
+using v8::Number;
+using v8::Object;
+using v8::ObjectTemplate;
+using v8::String;
+using v8::Value;
+
+typedef std::shared_ptr<std::vector<unsigned char>> Canvas;
+
+static void Set(Isolate *isolate, Local<Context> context, Local<Object> object, const char *key, Local<Value> value)
+{
+  object->Set(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked(), value).FromJust();
+}
+
+void DecoderWrapper::Init(v8::Local<v8::Function> encoder, v8::Local<v8::Context> context)
+{
+  Isolate *isolate = context->GetIsolate();
+
+  Local<ObjectTemplate> addon_data_tpl = ObjectTemplate::New(isolate);
+  addon_data_tpl->SetInternalFieldCount(1);
+  Local<Object> addon_data = addon_data_tpl->NewInstance(context).ToLocalChecked();
+
+  Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New, addon_data);
+  tpl->SetClassName(String::NewFromUtf8(isolate, "GIFDecoder", NewStringType::kNormal).ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  NODE_SET_PROTOTYPE_METHOD(tpl, "next", Next);
+
+  Local<Function> constructor = tpl->GetFunction(context).ToLocalChecked();
+  addon_data->SetInternalField(0, constructor);
+  Set(isolate, context, encoder, "Decoder", constructor);
+}
+
+/*
+  new Decoder(gif): reads the header of gif (any buffer accepted by
+  addFrame, copied). The instance gets width and height, and with the
+  first next() canvas, an RGBA Buffer sharing the decoder's memory that
+  every next() call redraws.
+*/
+void DecoderWrapper::New(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  if (!args.IsConstructCall())
+  {
+    // invoked as plain function `Decoder()`
+    Local<Value> argv[1] = {args[0]};
+    Local<Function> cons = args.Data().As<Object>()->GetInternalField(0).As<Function>();
+    Local<Object> result;
+    if (cons->NewInstance(context, 1, argv).ToLocal(&result))
+      args.GetReturnValue().Set(result);
+    return;
+  }
+
+  size_t length;
+  char *data = FrameData(args[0], length);
+  if (data == nullptr)
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "GIF data must be a Buffer, typed array or (Shared)ArrayBuffer", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  DecoderWrapper *wrapper = new DecoderWrapper(reinterpret_cast<unsigned char *>(data), length);
+  const GIFDecoder &decoder = wrapper->decoder;
+  if (!decoder.error.empty())
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, decoder.error.c_str(), NewStringType::kNormal).ToLocalChecked()));
+    delete wrapper;
+    return;
+  }
+  wrapper->Wrap(args.This());
+
+  Set(isolate, context, args.This(), "width", Number::New(isolate, decoder.width));
+  Set(isolate, context, args.This(), "height", Number::New(isolate, decoder.height));
+  Set(isolate, context, args.This(), "repeat", Number::New(isolate, decoder.repeat));
+
+  args.GetReturnValue().Set(args.This());
+}
+
+/*
+  next(): composites the next frame onto canvas and returns its index,
+  delay (hundredths), disposal and rectangle, or null after the last
+  frame. Throws on malformed data.
+*/
+void DecoderWrapper::Next(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  DecoderWrapper *wrapper = ObjectWrap::Unwrap<DecoderWrapper>(args.Holder());
+  GIFDecoder &decoder = wrapper->decoder;
+
+  if (!decoder.next())
+  {
+    if (!decoder.error.empty())
+      isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, decoder.error.c_str(), NewStringType::kNormal).ToLocalChecked()));
+    else
+      args.GetReturnValue().SetNull();
+    return;
+  }
+
+  // the loop extension usually precedes the first frame
+  Set(isolate, context, args.Holder(), "repeat", Number::New(isolate, decoder.repeat));
+
+  // the first frame allocated the canvas
+  if (!wrapper->canvasShared)
+  {
+    // the buffer holds its own reference, so it outlives a collected decoder
+    Canvas *owner = new Canvas(decoder.canvas);
+    std::unique_ptr<BackingStore> store = ArrayBuffer::NewBackingStore(
+        decoder.canvas->data(), decoder.canvas->size(),
+        [](void *, size_t, void *owner) { delete static_cast<Canvas *>(owner); },
+        owner);
+    Local<ArrayBuffer> canvas = ArrayBuffer::New(isolate, std::move(store));
+    Set(isolate, context, args.Holder(), "canvas", node::Buffer::New(isolate, canvas, 0, canvas->ByteLength()).ToLocalChecked());
+    wrapper->canvasShared = true;
+  }
+
+  const GIFDecoder::Frame &frame = decoder.frame;
+  Local<Object> result = Object::New(isolate);
+  Set(isolate, context, result, "index", Number::New(isolate, frame.index));
+  Set(isolate, context, result, "delay", Number::New(isolate, frame.delay));
+  Set(isolate, context, result, "disposal", Number::New(isolate, frame.disposal));
+  Set(isolate, context, result, "x", Number::New(isolate, frame.x));
+  Set(isolate, context, result, "y", Number::New(isolate, frame.y));
+  Set(isolate, context, result, "width", Number::New(isolate, frame.width));
+  Set(isolate, context, result, "height", Number::New(isolate, frame.height));
+
+  args.GetReturnValue().Set(result);
+}
+
+} // namespace gifencoder
@@ -0,0 +1,198 @@
+#include "frame-cache.h"
+#include "cstring"
+#include "random"
+
+namespace gifencoder
+{
+
+static inline uint64_t rotl(uint64_t x, int b)
+{
+  return (x << b) | (x >> (64 - b));
+}
+
+static inline void sipRound(uint64_t *v)
+{
+  v[0] += v[1];
+  v[1] = rotl(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = rotl(v[0], 32);
+  v[2] += v[3];
+  v[3] = rotl(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = rotl(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = rotl(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = rotl(v[2], 32);
+}
+
+// the process wide SipHash key, k[0] and k[1]
+static const uint64_t *hashKey()
+{
+  static const uint64_t *key = [] {
+    static uint64_t k[2];
+    std::random_device random;
+    for (uint64_t &word : k)
+      word = (uint64_t(random()) << 32) ^ random();
+    return k;
+  }();
+  return key;
+}
+
+FrameHasher::FrameHasher() : FrameHasher(hashKey()[0], hashKey()[1])
+{
+}
+
+FrameHasher::FrameHasher(uint64_t k0, uint64_t k1)
+{
+  v[0] = k0 ^ 0x736f6d6570736575ULL;
+  v[1] = k1 ^ 0x646f72616e646f6dULL ^ 0xee; // 0xee selects 128 bit output
+  v[2] = k0 ^ 0x6c7967656e657261ULL;
+  v[3] = k1 ^ 0x7465646279746573ULL;
+}
+
+void FrameHasher::compress(uint64_t word)
+{
+  v[3] ^= word;
+  sipRound(v);
+  sipRound(v);
+  v[0] ^= word;
+}
+
+void FrameHasher::update(const void *data, size_t count)
+{
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  length += count;
+
+  // finish a word begun by the last call
+  while (tailBytes > 0 && tailBytes < 8 && count > 0)
+  {
+    tail |= uint64_t(*bytes++) << (8 * tailBytes++);
+    count--;
+  }
+  if (tailBytes == 8)
+  {
+    compress(tail);
+    tail = 0;
+    tailBytes = 0;
+  }
+
+  for (; count >= 8; bytes += 8, count -= 8)
+  {
+    uint64_t word;
+    memcpy(&word, bytes, 8); // little endian hosts only, like the rest of the encoder
+    compress(word);
+  }
+  for (; count > 0; count--)
+    tail |= uint64_t(*bytes++) << (8 * tailBytes++);
+}
+
+FrameKey FrameHasher::finish()
+{
+  compress((length << 56) | tail);
+  FrameKey key;
+  v[2] ^= 0xee;
+  for (int i = 0; i < 4; i++)
+    sipRound(v);
+  key.hash[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+  v[1] ^= 0xdd;
+  for (int i = 0; i < 4; i++)
+    sipRound(v);
+  key.hash[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
+  return key;
+}
+
+FrameCache &FrameCache::shared()
+{
+  // never destroyed, encoders may still use it during exit
+  static FrameCache *cache = new FrameCache();
+  return *cache;
+}
+
+FrameCache::FrameCache()
+{
+  counts.capacity = defaultCapacity;
+}
+
+size_t FrameCache::entryBytes(const CachedFrame &frame)
+{
+  // the data plus a rough allowance for the list and map nodes
+  return sizeof(CachedFrame) + frame.data.size() + 128;
+}
+
+void FrameCache::setCapacity(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  counts.capacity = bytes;
+  evict(bytes);
+}
+
+std::shared_ptr<const CachedFrame> FrameCache::find(const FrameKey &key)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (counts.capacity == 0)
+    return nullptr;
+
+  auto found = byKey.find(key);
+  if (found == byKey.end())
+  {
+    counts.misses++;
+    return nullptr;
+  }
+
+  counts.hits++;
+  entries.splice(entries.begin(), entries, found->second);
+  return found->second->second;
+}
+
+void FrameCache::insert(const FrameKey &key, std::shared_ptr<const CachedFrame> frame)
+{
+  size_t bytes = entryBytes(*frame);
+  std::lock_guard<std::mutex> guard(lock);
+  if (bytes > counts.capacity)
+    return;
+
+  auto found = byKey.find(key);
+  if (found != byKey.end())
+  {
+    counts.bytes -= entryBytes(*found->second->second);
+    entries.erase(found->second);
+    byKey.erase(found);
+  }
+
+  evict(counts.capacity - bytes);
+  entries.emplace_front(key, std::move(frame));
+  byKey[key] = entries.begin();
+  counts.bytes += bytes;
+}
+
+void FrameCache::clear()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  entries.clear();
+  byKey.clear();
+  counts.bytes = 0;
+}
+
+FrameCacheStats FrameCache::statistics()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  FrameCacheStats result = counts;
+  result.entries = entries.size();
+  return result;
+}
+
+void FrameCache::evict(size_t limit)
+{
+  while (counts.bytes > limit && !entries.empty())
+  {
+    counts.bytes -= entryBytes(*entries.back().second);
+    byKey.erase(entries.back().first);
+    entries.pop_back();
+    counts.evictions++;
+  }
+}
+
+} // namespace gifencoder
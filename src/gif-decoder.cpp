@@ -0,0 +1,447 @@
+#include "gif-decoder.h"
+#include "algorithm"
+#include "cstring"
+#include "new"
+
+using namespace std;
+
+namespace gifencoder
+{
+
+GIFDecoder::GIFDecoder(const unsigned char *bytes, size_t length, bool copyData)
+{
+  if (copyData)
+  {
+    input.assign(bytes, bytes + length);
+    bytes = input.data();
+  }
+  data = bytes;
+  dataLength = length;
+  globalTab.fill(0);
+  localTab.fill(0);
+  readHeader();
+}
+
+GIFDecoder::GIFDecoder(vector<unsigned char> &&bytes) : input(move(bytes))
+{
+  data = input.data();
+  dataLength = input.size();
+  globalTab.fill(0);
+  localTab.fill(0);
+  readHeader();
+}
+
+bool GIFDecoder::fail(const char *message)
+{
+  if (error.empty())
+    error = message;
+  done = true;
+  return false;
+}
+
+/*
+  Reads the header, logical screen descriptor and global color table
+*/
+bool GIFDecoder::readHeader()
+{
+  if (dataLength < 13 || (memcmp(data, "GIF87a", 6) != 0 && memcmp(data, "GIF89a", 6) != 0))
+    return fail("Not a GIF");
+
+  width = data[6] | (data[7] << 8);
+  height = data[8] | (data[9] << 8);
+  int packed = data[10];
+  pos = 13;
+
+  if (width == 0 || height == 0)
+    return fail("GIF has an empty logical screen");
+
+  if (packed & 0x80)
+  {
+    globalSize = 2 << (packed & 7);
+    if (pos + globalSize * 3 > dataLength)
+      return fail("Truncated global color table");
+    copy(data + pos, data + pos + globalSize * 3, globalTab.begin());
+    pos += globalSize * 3;
+  }
+  return true;
+}
+
+bool GIFDecoder::allocateCanvas()
+{
+  // frames start out over a transparent canvas
+  if (size_t(width) * height > maxScreenPixels)
+    return fail("GIF logical screen is too large to decode");
+  try
+  {
+    canvas = make_shared<vector<unsigned char>>(size_t(width) * height * 4, 0);
+  }
+  catch (const bad_alloc &)
+  {
+    return fail("Not enough memory for the GIF canvas");
+  }
+  return true;
+}
+
+bool GIFDecoder::next()
+{
+  if (done)
+    return false;
+
+  Frame next;
+  next.index = frame.index + 1;
+
+  while (true)
+  {
+    // a missing trailer ends the animation like a present one
+    if (pos >= dataLength)
+    {
+      done = true;
+      return false;
+    }
+
+    int block = data[pos++];
+    if (block == 0x3b) // trailer
+    {
+      done = true;
+      return false;
+    }
+    if (block == 0x21) // extension introducer
+    {
+      readExtension(next);
+      if (done)
+        return false;
+      continue;
+    }
+    if (block != 0x2c)
+      return fail("Unknown block in GIF data");
+
+    // image descriptor
+    if (pos + 9 > dataLength)
+      return fail("Truncated image descriptor");
+    next.x = data[pos] | (data[pos + 1] << 8);
+    next.y = data[pos + 2] | (data[pos + 3] << 8);
+    next.width = data[pos + 4] | (data[pos + 5] << 8);
+    next.height = data[pos + 6] | (data[pos + 7] << 8);
+    int packed = data[pos + 8];
+    next.interlaced = (packed & 0x40) != 0;
+    pos += 9;
+    // bounds what decodeIndices allocates by the screen, not the descriptor
+    if (next.x + next.width > width || next.y + next.height > height)
+      return fail("Frame lies outside the logical screen");
+
+    const unsigned char *table = globalTab.data();
+    int tableSize = globalSize;
+    if (packed & 0x80)
+    {
+      tableSize = 2 << (packed & 7);
+      if (pos + tableSize * 3 > dataLength)
+        return fail("Truncated local color table");
+      copy(data + pos, data + pos + tableSize * 3, localTab.begin());
+      pos += tableSize * 3;
+      table = localTab.data();
+    }
+
+    if (pos >= dataLength)
+      return fail("Truncated image data");
+    int minCodeSize = data[pos++];
+    if (!readBlocks())
+      return false;
+
+    if (!canvas && !allocateCanvas())
+      return false;
+    dispose(); // of the previous frame
+    frame = next;
+    if (frame.disposal == 3)
+      previous = *canvas;
+
+    if (!decodeIndices(minCodeSize, size_t(frame.width) * frame.height))
+      return false;
+    draw(table, tableSize);
+
+    haveFrame = true;
+    return true;
+  }
+}
+
+size_t GIFDecoder::findTrailer(int &frames)
+{
+  frames = 0;
+  Frame ignored;
+  while (!done)
+  {
+    if (pos >= dataLength || data[pos] == 0x3b)
+      return pos;
+
+    int block = data[pos++];
+    if (block == 0x21)
+    {
+      readExtension(ignored);
+      continue;
+    }
+    if (block != 0x2c)
+    {
+      fail("Unknown block in GIF data");
+      break;
+    }
+
+    if (pos + 9 > dataLength)
+    {
+      fail("Truncated image descriptor");
+      break;
+    }
+    int packed = data[pos + 8];
+    pos += 9;
+    if (packed & 0x80)
+      pos += (2 << (packed & 7)) * 3;
+    pos++; // LZW minimum code size
+    if (!skipBlocks())
+      break;
+    frames++;
+  }
+  return 0;
+}
+
+/*
+  Reads an extension, picking up the graphic control extension of the
+  next image and the Netscape loop count
+*/
+void GIFDecoder::readExtension(Frame &next)
+{
+  if (pos >= dataLength)
+  {
+    fail("Truncated extension");
+    return;
+  }
+  int label = data[pos++];
+
+  if (label == 0xf9 && pos + 5 <= dataLength && data[pos] >= 4)
+  {
+    int packed = data[pos + 1];
+    next.disposal = (packed >> 2) & 7;
+    next.delay = data[pos + 2] | (data[pos + 3] << 8);
+    next.transparentIndex = (packed & 1) ? data[pos + 4] : -1;
+  }
+  else if (label == 0xff && pos + 16 <= dataLength && data[pos] == 11 &&
+           memcmp(&data[pos + 1], "NETSCAPE2.0", 11) == 0 &&
+           data[pos + 12] >= 3 && data[pos + 13] == 1)
+  {
+    repeat = data[pos + 14] | (data[pos + 15] << 8);
+  }
+
+  skipBlocks();
+}
+
+bool GIFDecoder::skipBlocks()
+{
+  while (true)
+  {
+    if (pos >= dataLength)
+      return fail("Truncated data sub-blocks");
+    int size = data[pos++];
+    if (size == 0)
+      return true;
+    pos += size;
+  }
+}
+
+// Joins the image data sub-blocks into blocks
+bool GIFDecoder::readBlocks()
+{
+  blocks.clear();
+  while (true)
+  {
+    if (pos >= dataLength)
+      return fail("Truncated image data");
+    int size = data[pos++];
+    if (size == 0)
+      return true;
+    if (pos + size > dataLength)
+      return fail("Truncated image data");
+    blocks.insert(blocks.end(), data + pos, data + pos + size);
+    pos += size;
+  }
+}
+
+/*
+  LZW decodes blocks into count palette indices. Short data leaves the
+  rest of the frame at index 0, as browsers do.
+*/
+bool GIFDecoder::decodeIndices(int minCodeSize, size_t count)
+{
+  static const int maxCodes = 4096;
+
+  if (minCodeSize < 1 || minCodeSize > 11)
+    return fail("Invalid LZW code size");
+
+  indices.assign(count, 0);
+
+  unsigned short prefix[maxCodes];
+  unsigned char suffix[maxCodes];
+  unsigned char stack[maxCodes + 1];
+
+  int clear = 1 << minCodeSize;
+  int eoi = clear + 1;
+  for (int i = 0; i < clear; i++)
+  {
+    prefix[i] = 0;
+    suffix[i] = i;
+  }
+
+  int codeSize = minCodeSize + 1;
+  int codeMask = (1 << codeSize) - 1;
+  int avail = clear + 2;
+  int old = -1;
+  int first = 0;
+
+  unsigned int datum = 0;
+  int bits = 0;
+  size_t in = 0;
+  size_t out = 0;
+
+  while (out < count)
+  {
+    while (bits < codeSize)
+    {
+      if (in >= blocks.size())
+        return true;
+      datum |= (unsigned int)blocks[in++] << bits;
+      bits += 8;
+    }
+    int code = datum & codeMask;
+    datum >>= codeSize;
+    bits -= codeSize;
+
+    if (code == clear)
+    {
+      codeSize = minCodeSize + 1;
+      codeMask = (1 << codeSize) - 1;
+      avail = clear + 2;
+      old = -1;
+      continue;
+    }
+    if (code == eoi)
+      break;
+
+    if (old == -1)
+    {
+      if (code >= clear)
+        break; // corrupt, keep what was decoded
+      indices[out++] = suffix[code];
+      old = first = code;
+      continue;
+    }
+
+    int current = code;
+    int top = 0;
+    if (code >= avail)
+    {
+      if (code > avail)
+        break; // corrupt
+      stack[top++] = first; // the KwKwK case
+      code = old;
+    }
+    while (code >= clear)
+    {
+      stack[top++] = suffix[code];
+      code = prefix[code];
+    }
+    first = suffix[code];
+    stack[top++] = first;
+
+    if (avail < maxCodes)
+    {
+      prefix[avail] = old;
+      suffix[avail] = first;
+      avail++;
+      if ((avail & codeMask) == 0 && avail < maxCodes)
+      {
+        codeSize++;
+        codeMask += avail;
+      }
+    }
+    old = current;
+
+    while (top > 0 && out < count)
+      indices[out++] = stack[--top];
+  }
+
+  return true;
+}
+
+// Applies the disposal method of the frame decoded last
+void GIFDecoder::dispose()
+{
+  if (!haveFrame)
+    return;
+
+  if (frame.disposal == 2)
+  {
+    // restore to background, which browsers treat as transparent
+    int x1 = min(frame.x + frame.width, width);
+    int y1 = min(frame.y + frame.height, height);
+    for (int y = frame.y; y < y1; y++)
+    {
+      if (frame.x < x1)
+        fill(canvas->begin() + (size_t(y) * width + frame.x) * 4, canvas->begin() + (size_t(y) * width + x1) * 4, 0);
+    }
+  }
+  else if (frame.disposal == 3 && previous.size() == canvas->size())
+  {
+    // copied rather than swapped, the canvas memory must not move
+    copy(previous.begin(), previous.end(), canvas->begin());
+  }
+}
+
+// Composites the indices of the current frame onto the canvas
+void GIFDecoder::draw(const unsigned char *table, int tableSize)
+{
+  // destination row of every stored row
+  vector<int> rows(frame.height);
+  if (frame.interlaced)
+  {
+    static const int start[4] = {0, 4, 2, 1};
+    static const int step[4] = {8, 8, 4, 2};
+    int i = 0;
+    for (int pass = 0; pass < 4; pass++)
+      for (int y = start[pass]; y < frame.height; y += step[pass])
+        rows[i++] = y;
+  }
+  else
+  {
+    for (int y = 0; y < frame.height; y++)
+      rows[y] = y;
+  }
+
+  int columns = min(frame.width, width - frame.x);
+  if (columns <= 0)
+    return;
+  unsigned char *pixels = canvas->data();
+  for (int i = 0; i < frame.height; i++)
+  {
+    int y = frame.y + rows[i];
+    if (y >= height)
+      continue;
+
+    const unsigned char *src = &indices[size_t(i) * frame.width];
+    unsigned char *dst = pixels + (size_t(y) * width + frame.x) * 4;
+    for (int x = 0; x < columns; x++, dst += 4)
+    {
+      int index = src[x];
+      if (index == frame.transparentIndex)
+        continue;
+      if (index < tableSize)
+      {
+        dst[0] = table[index * 3];
+        dst[1] = table[index * 3 + 1];
+        dst[2] = table[index * 3 + 2];
+      }
+      else
+      {
+        dst[0] = dst[1] = dst[2] = 0;
+      }
+      dst[3] = 255;
+    }
+  }
+}
+
+} // namespace gifencoder
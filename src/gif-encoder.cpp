@@ -3,8 +3,16 @@
 #include "typed-neu-quant.h"
 #include "lzw-encoder.h"
 #include "cmath"
+#include "algorithm"
+#include "cstring"
+#include "fstream"
+#include "iterator"
 #include <chrono>
 #include "iostream"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace gifencoder
 {
@@ -12,195 +20,1891 @@ namespace gifencoder
 GIFEncoder::GIFEncoder(int w, int h) : 
   width(~~w), 
   height(~~h), 
-  pixels(new char[(w*h)*3]),
+  pixels(new char[size_t(w) * h * 3]),
   pixLen((w * h) * 3),
-  indexedPixels(new char[w * h])
+  indexedPixels(new char[size_t(w) * h]),
+  pixelCapacity(size_t(w) * h)
 {
+  region = FrameRect{0, 0, width, height};
 };
 
 GIFEncoder::~GIFEncoder(){
-  // delete[] pixels;
-  // delete[] indexedPixels;
+  delete[] pixels;
+  delete[] indexedPixels;
 };
 
+void GIFEncoder::reset(int w, int h)
+{
+  if (w <= 0)
+    w = width;
+  if (h <= 0)
+    h = height;
+
+  if (w != width || h != height)
+    overlay.clear(); // clipped to the old size
+  size_t nPix = size_t(w) * h;
+  if (nPix > pixelCapacity)
+  {
+    delete[] pixels;
+    delete[] indexedPixels;
+    pixels = nullptr;
+    indexedPixels = nullptr;
+    pixelCapacity = 0;
+    pixels = new char[nPix * 3];
+    indexedPixels = new char[nPix];
+    pixelCapacity = nPix;
+  }
+  width = w;
+  height = h;
+  pixLen = (w * h) * 3;
+  region = FrameRect{0, 0, w, h};
+
+  // drop what an unfinished animation left, keeping the capacity
+  out.data.clear();
+  out.close();
+  out.written = 0;
+  out.error = 0;
+
+  started = false;
+  firstFrame = true;
+  usedEntry.reset();
+  usedIndex.clear();
+  transIndex = 0;
+  alphaMask.clear();
+  stats = FrameStats();
+
+  frameCount = 0;
+  spentMs = 0;
+  warmFrames = 0;
+  warmNetwork[0].resize(0);
+  pendingFrames.clear();
+  pendingPixels.clear();
+  if (!fixedPalette)
+    globalIndex.clear();
+  haveLastFrame = false;
+  haveCanvas = false;
+  screenIndex.clear();
+  rowEncoder.reset();
+  rowsDone = 0;
+
+  for (auto &size : sizes)
+    size->reset();
+}
+
 void GIFEncoder::start()
 {
   out.writeUTFBytes("GIF89a");
   started = true;
+
+  for (auto &size : sizes)
+    size->start();
+}
+
+void GIFEncoder::finish()
+{
+  if (!pendingFrames.empty())
+    flushPendingFrames();
+
+  out.writeByte(0x3b);
+  out.close();
+
+  for (auto &size : sizes)
+    size->finish();
+}
+
+bool GIFEncoder::setOutput(const string &path)
+{
+  return out.open(path);
+}
+
+void GIFEncoder::setOutput(int fd)
+{
+  out.attach(fd);
+}
+
+bool GIFEncoder::append(const unsigned char *gif, size_t length, string &error)
+{
+  GIFDecoder existing(gif, length, false);
+  int frames;
+  size_t end = existing.findTrailer(frames);
+  if (!resumeFrom(existing, error))
+    return false;
+
+  out.data.assign(gif, gif + end);
+  return true;
+}
+
+bool GIFEncoder::appendFile(const string &path, string &error)
+{
+  // the blocks are walked in a read-only mapping, nothing is copied
+  int file = ::open(path.c_str(), O_RDONLY);
+  struct stat info;
+  if (file < 0 || fstat(file, &info) != 0)
+  {
+    error = "Cannot read " + path;
+    if (file >= 0)
+      ::close(file);
+    return false;
+  }
+  size_t length = size_t(info.st_size);
+  void *mapped = length > 0 ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0) : nullptr;
+  ::close(file);
+  if (mapped == MAP_FAILED)
+  {
+    error = "Cannot map " + path;
+    return false;
+  }
+
+  size_t end;
+  bool resumed;
+  {
+    GIFDecoder existing(static_cast<const unsigned char *>(mapped), length, false);
+    int frames;
+    end = existing.findTrailer(frames);
+    resumed = resumeFrom(existing, error);
+  }
+  if (mapped != nullptr)
+    munmap(mapped, length);
+  if (!resumed)
+    return false;
+
+  out.data.clear();
+  if (!out.openAt(path, end))
+  {
+    error = strerror(out.error);
+    return false;
+  }
+  return true;
+}
+
+bool GIFEncoder::resumeFrom(const GIFDecoder &gif, string &error)
+{
+  if (started || out.size() > 0)
+  {
+    error = "Only a fresh encoder can continue a GIF, before start or any frame";
+    return false;
+  }
+  if (!gif.error.empty())
+  {
+    error = gif.error;
+    return false;
+  }
+  if (gif.width != width || gif.height != height)
+  {
+    error = "GIF size differs from the encoder's";
+    return false;
+  }
+  if (fixedPalette)
+  {
+    error = "A fixed palette can't continue an existing GIF";
+    return false;
+  }
+
+  if (globalPaletteFrames > 0 && gif.globalColorCount() > 0)
+  {
+    // new frames map against the table already in the file
+    int count = gif.globalColorCount();
+    globalTab.fill(0);
+    copy(gif.globalColors(), gif.globalColors() + count * 3, globalTab.begin());
+    globalIndex.build(globalTab.data(), count);
+  }
+  screenColors = max(2, gif.globalColorCount());
+  screenTab.fill(0);
+  copy(gif.globalColors(), gif.globalColors() + gif.globalColorCount() * 3, screenTab.begin());
+  screenIndex.clear();
+
+  // the header, screen descriptor and loop extension are already written
+  started = true;
+  firstFrame = false;
+  haveLastFrame = false;
+  haveCanvas = false; // the last frame's pixels aren't known
+  return true;
+}
+
+void GIFEncoder::setRepeat(int r = 0)
+{
+  repeat = r;
+}
+
+void GIFEncoder::setQuality(int q)
+{
+  if (q < 1)
+    q = 1;
+
+  sample = q;
+}
+
+void GIFEncoder::setHistogramQuantizer(bool enable, int threads)
+{
+  if (threads < 1)
+    threads = 1;
+
+  histogramQuantizer = enable;
+  quantizerThreads = threads;
+}
+
+void GIFEncoder::setPriority(int priority)
+{
+  tasks.setPriority(priority);
+}
+
+void GIFEncoder::setWarmStart(bool enable, int interval)
+{
+  warmStart = enable;
+  keyframeInterval = interval > 0 ? interval : 0;
+  warmFrames = 0;
+  warmNetwork[0].resize(0);
+}
+
+void GIFEncoder::setGlobalPalette(int frames, double maxError)
+{
+  if (fixedPalette)
+  {
+    fixedPalette = false;
+    globalIndex.clear();
+  }
+  globalPaletteFrames = frames > 0 ? frames : 0;
+  maxPaletteError = maxError;
+}
+
+void GIFEncoder::setLossy(int level)
+{
+  if (level < 0)
+    level = 0;
+
+  lossy = level;
+}
+
+void GIFEncoder::setDeferredClear(bool defer)
+{
+  deferReset = defer;
+}
+
+void GIFEncoder::setOptimize(int level)
+{
+  optimizeLevel = min(max(level, 0), 3);
+  haveCanvas = false;
+}
+
+void GIFEncoder::setOverlay(const unsigned char *rgba, int w, int h, int x, int y, BlendMode mode)
+{
+  if (rgba == nullptr)
+    overlay.clear();
+  else
+    overlay.set(rgba, w, h, x, y, mode, width, height);
+}
+
+bool GIFEncoder::setPerfCounters(bool enable)
+{
+  if (!enable)
+  {
+    perf.close();
+    return false;
+  }
+  return perf.enabled() || perf.open();
+}
+
+PerfSample GIFEncoder::beginStage() const
+{
+  PerfSample start = perf.enabled() ? perf.read() : PerfSample();
+  start.poolTasks = ThreadPool::submittedByThread();
+  return start;
+}
+
+void GIFEncoder::endStage(PerfStage stage, const PerfSample &start)
+{
+  if (!perf.enabled())
+    return;
+  PerfSample &total = stats.counters[stage];
+  perf.addSince(start, total);
+  // pool workers did part of the stage, which the counters don't see;
+  // runParallel keeps the stages inline, this guards the rest
+  total.poolTasks += ThreadPool::submittedByThread() - start.poolTasks;
+  if (total.poolTasks > 0)
+    for (int64_t &v : total.value)
+      v = -1;
+}
+
+void GIFEncoder::runParallel(int count, const function<void(int)> &function)
+{
+  if (!perf.enabled())
+  {
+    tasks.parallel(count, function);
+    return;
+  }
+  for (int i = 0; i < count; i++)
+    function(i);
+}
+
+void GIFEncoder::setDuplicateFrames(bool enable, int tolerance)
+{
+  dropDuplicates = enable;
+  duplicateTolerance = tolerance > 0 ? tolerance : 0;
+  haveLastFrame = false;
+}
+
+void GIFEncoder::setFrameCache(bool enable)
+{
+  useFrameCache = enable;
+}
+
+void GIFEncoder::setFrameRate(int fps)
+{
+  delay = round(100 / fps);
+}
+
+// milliseconds since t
+static double elapsedMs(chrono::high_resolution_clock::time_point t)
+{
+  return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t).count();
+}
+
+void GIFEncoder::setTimeBudget(double frameMs, double totalMs, int frames)
+{
+  frameBudget = frameMs > 0 ? frameMs : 0;
+  totalBudget = totalMs > 0 ? totalMs : 0;
+  budgetFrames = frames > 0 ? frames : 0;
+  spentMs = 0;
+  frameCount = 0;
+}
+
+void GIFEncoder::tuneForBudget()
+{
+  stats.sample = sample;
+  stats.cycles = 100;
+  stats.histogram = histogramQuantizer;
+  stats.lossy = lossy;
+  stats.deferReset = deferReset;
+  stats.budgetMs = 0;
+
+  if (frameBudget == 0 && totalBudget == 0)
+    return;
+
+  double budget = frameBudget;
+  if (totalBudget > 0 && budgetFrames > 0)
+  {
+    double share = (totalBudget - spentMs) / max(1, budgetFrames - frameCount);
+    budget = budget > 0 ? min(budget, share) : share;
+  }
+  stats.budgetMs = budget;
+
+  // Try, from best to cheapest: the configured LZW with the pixel sampler
+  // then the histogram quantizer, then the same with plain lossless LZW.
+  // Each takes the finest sampling that still fits the budget.
+  int nPix = pixLen / 3;
+  int binSamples = histogramBins * TypedNeuQuant::histogramSamples;
+  bool plainConfigured = lossy == 0 && !deferReset;
+
+  for (int plain = plainConfigured ? 1 : 0; plain < 2; plain++)
+  {
+    for (int histogram = histogramQuantizer ? 1 : 0; histogram < 2; histogram++)
+    {
+      double available = budget - nPix * (pixelCost + (plain ? plainLzwCost : lzwCost));
+      if (histogram)
+        available -= nPix * histogramCost;
+      if (available <= 0)
+        continue;
+
+      int maxSamples = int(available / learnCost);
+      int s = sample;
+      if (!histogram || binSamples > maxSamples)
+        s = max(sample, maxSamples > 0 ? (nPix + maxSamples - 1) / maxSamples : nPix);
+      if (s > 30)
+        continue;
+
+      stats.sample = s;
+      stats.histogram = histogram;
+      if (plain && !plainConfigured)
+      {
+        stats.lossy = 0;
+        stats.deferReset = false;
+      }
+      if (histogram)
+        stats.cycles = max(10, min(100, min(nPix / s, binSamples) / 64));
+      return;
+    }
+  }
+
+  // nothing fits, take the cheapest settings
+  stats.sample = 30;
+  stats.histogram = true;
+  stats.cycles = max(10, min(100, min(nPix / 30, binSamples) / 64));
+  stats.lossy = 0;
+  stats.deferReset = false;
+}
+
+void GIFEncoder::updateCosts()
+{
+  const double weight = 0.5; // how quickly the model follows new frames
+  int nPix = pixLen / 3;
+
+  double other = stats.unpackMs + stats.mapMs + stats.writeMs;
+  pixelCost += weight * (other / nPix - pixelCost);
+
+  if (stats.lossy == 0 && !stats.deferReset)
+    plainLzwCost += weight * (stats.lzwMs / nPix - plainLzwCost);
+  else
+    lzwCost += weight * (stats.lzwMs / nPix - lzwCost);
+
+  double training = stats.learnMs - stats.histogramMs;
+  if (stats.samples > 0 && training > 0)
+    learnCost += weight * (training / stats.samples - learnCost);
+  if (stats.histogram)
+    histogramCost += weight * (stats.histogramMs / nPix - histogramCost);
+
+  spentMs += stats.totalMs;
+  frameCount++;
+}
+
+bool GIFEncoder::extendLastDelay(unsigned int extra)
+{
+  unsigned int merged = lastDelay + extra;
+  if (merged > 0xffff)
+    return false;
+
+  lastDelay = merged;
+  size_t pos = lastDelayPos - out.written;
+  out.data[pos] = merged & 0xff;
+  out.data[pos + 1] = (merged >> 8) & 0xff;
+  return true;
+}
+
+bool GIFEncoder::mergeDuplicate()
+{
+  // a region isn't the picture on screen, nor is what follows comparable
+  if (partialFrame())
+  {
+    haveLastFrame = false;
+    return false;
+  }
+
+  // compared byte for byte, a hash collision must not drop a frame
+  bool same = false;
+  if (haveLastFrame && alphaMask == lastAlphaMask && int(lastPixels.size()) == pixLen)
+  {
+    if (duplicateTolerance == 0)
+      same = memcmp(pixels, lastPixels.data(), pixLen) == 0;
+    else
+    {
+      same = true;
+      for (int i = 0; i < pixLen && same; i++)
+        same = abs((unsigned char)pixels[i] - (unsigned char)lastPixels[i]) <= duplicateTolerance;
+    }
+  }
+
+  if (same)
+  {
+    // frames still held back for the global palette keep their delay there
+    if (!pendingFrames.empty())
+    {
+      unsigned int merged = pendingFrames.back().delay + delay;
+      if (merged <= 0xffff)
+      {
+        pendingFrames.back().delay = merged;
+        return true;
+      }
+    }
+    else if (extendLastDelay(delay))
+    {
+      for (auto &size : sizes)
+        size->extendLastDelay(delay);
+      return true;
+    }
+  }
+
+  // a distinct frame (or one whose merged delay would overflow) becomes
+  // the reference for the next
+  haveLastFrame = true;
+  lastPixels.assign(pixels, pixels + pixLen);
+  lastAlphaMask = alphaMask;
+  return false;
+}
+
+void GIFEncoder::addFrame(char* frame, const FrameDescriptor &desc)
+{
+  image = frame;
+  imageDesc = desc;
+
+  stats.perf = perf.enabled();
+  for (PerfSample &c : stats.counters)
+    c = PerfSample();
+
+  auto t1 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  getImagePixels(); // convert to correct format if necessary
+  stats.overlayMs = 0;
+  if (!overlay.empty())
+  {
+    auto t2 = chrono::high_resolution_clock::now();
+    overlay.apply(pixels, region.width, alphaMask, region.y, region.height, region.x);
+    stats.overlayMs = elapsedMs(t2);
+  }
+  stats.unpackMs = elapsedMs(t1);
+  endStage(STAGE_UNPACK, p);
+
+  if (dropDuplicates && mergeDuplicate())
+  {
+    double unpackMs = stats.unpackMs;
+    double overlayMs = stats.overlayMs;
+    PerfSample unpackCounters = stats.counters[STAGE_UNPACK];
+    stats = FrameStats();
+    stats.duplicate = true;
+    stats.unpackMs = unpackMs;
+    stats.overlayMs = overlayMs;
+    stats.perf = perf.enabled();
+    stats.counters[STAGE_UNPACK] = unpackCounters;
+    stats.totalMs = elapsedMs(t1);
+    return;
+  }
+  stats.duplicate = false;
+  stats.cached = false;
+
+  if (!sizes.empty())
+  {
+    encodeSizes();
+    return;
+  }
+
+  // only the first frame can still bring a global table, after it (or
+  // when continuing a GIF without one) frames get local tables
+  if (globalPaletteFrames > 0 && globalIndex.empty() && firstFrame)
+  {
+    // hold the frame back until the global palette is trained
+    pendingPixels.insert(pendingPixels.end(), pixels, pixels + pixLen);
+    pendingFrames.push_back(PendingFrame{alphaMask, delay, region});
+    if (int(pendingFrames.size()) >= globalPaletteFrames)
+      flushPendingFrames();
+    return;
+  }
+
+  encodeFrame();
+}
+
+bool GIFEncoder::addFrameRegion(char *frame, const FrameDescriptor &desc, const FrameRect &rect, string &error)
+{
+  if (rect.width <= 0 || rect.height <= 0 || rect.x < 0 || rect.y < 0 ||
+      rect.x > width - rect.width || rect.y > height - rect.height)
+  {
+    error = "Region is outside the screen";
+    return false;
+  }
+  if (!sizes.empty())
+  {
+    error = "Regions can't be scaled to extra output sizes";
+    return false;
+  }
+
+  region = rect;
+  pixLen = rect.width * rect.height * 3;
+  addFrame(frame, desc);
+  region = FrameRect{0, 0, width, height};
+  pixLen = width * height * 3;
+  return true;
+}
+
+void GIFEncoder::flushPendingFrames()
+{
+  int count = pendingFrames.size();
+  char *trainPixels = pendingPixels.data();
+  TypedNeuQuant quant(trainPixels, sample, int(pendingPixels.size()));
+  quant.useHistogram = histogramQuantizer;
+  quant.threads = quantizerThreads;
+  quant.tasks = &tasks;
+  quant.buildColormap();
+  quant.getColormap(globalTab);
+  globalIndex.build(globalTab.data(), 256);
+
+  unsigned int frameDelay = delay;
+  size_t offset = 0;
+  for (int i = 0; i < count; i++)
+  {
+    region = pendingFrames[i].region;
+    pixLen = region.width * region.height * 3;
+    copy(pendingPixels.begin() + offset, pendingPixels.begin() + offset + pixLen, pixels);
+    offset += pixLen;
+    alphaMask.swap(pendingFrames[i].alphaMask);
+    delay = pendingFrames[i].delay;
+    stats.unpackMs = 0;
+    encodeFrame();
+  }
+  delay = frameDelay;
+  region = FrameRect{0, 0, width, height};
+  pixLen = width * height * 3;
+
+  pendingFrames.clear();
+  pendingPixels.clear();
+  pendingPixels.shrink_to_fit();
+}
+
+void GIFEncoder::encodeFrame()
+{
+  auto start = chrono::high_resolution_clock::now();
+  size_t startBytes = out.size();
+  tuneForBudget();
+
+  // unpack was counted by addFrame, held back frames only get the rest
+  for (int i = STAGE_LEARN; i < PERF_STAGES; i++)
+    stats.counters[i] = PerfSample();
+
+  // the palette of a global or warm started frame depends on other frames
+  bool cacheable = useFrameCache && globalIndex.empty() && !warmStart;
+  FrameKey key;
+  shared_ptr<const CachedFrame> cached;
+  if (cacheable)
+  {
+    key = frameKey();
+    cached = FrameCache::shared().find(key);
+  }
+
+  stats.cached = cached != nullptr;
+  if (cached)
+  {
+    encodeCached(*cached);
+    stats.totalMs = elapsedMs(start) + stats.unpackMs;
+    stats.bytes = out.size() - startBytes;
+    // nothing was trained or compressed, the cost model would only drift
+    spentMs += stats.totalMs;
+    frameCount++;
+    // an optimized frame left its data out, keep it for the next time
+    if (optimizeLevel == 0 && cached->data.empty())
+    {
+      auto frame = make_shared<CachedFrame>(*cached);
+      frame->data.assign(out.data.begin() + pixelDataPos, out.data.end());
+      FrameCache::shared().insert(key, move(frame));
+    }
+    return;
+  }
+
+  analyzePixels(); // build color table & map pixels
+  // before writeFrame, the optimizer may leave a trimmed table behind
+  shared_ptr<CachedFrame> frame;
+  if (cacheable)
+  {
+    frame = make_shared<CachedFrame>();
+    copy(colorTab.begin(), colorTab.end(), frame->palette.begin());
+    frame->transIndex = transIndex;
+  }
+  writeFrame();
+
+  if (frame)
+  {
+    // the data of an optimized frame is only of one candidate rect
+    if (optimizeLevel == 0)
+      frame->data.assign(out.data.begin() + pixelDataPos, out.data.end());
+    FrameCache::shared().insert(key, move(frame));
+  }
+
+  stats.totalMs = elapsedMs(start) + stats.unpackMs;
+  stats.bytes = out.size() - startBytes;
+  updateCosts();
+}
+
+FrameKey GIFEncoder::frameKey() const
+{
+  // everything besides the pixels the palette and LZW data depend on
+  int64_t options[] = {
+      region.width, region.height, stats.sample, stats.cycles, stats.histogram, quantizerThreads,
+      stats.lossy, stats.deferReset,
+      transparent.has_value() ? int64_t(transparent.value()) : -1};
+
+  FrameHasher hasher;
+  hasher.update(options, sizeof(options));
+  hasher.update(pixels, pixLen);
+  hasher.update(alphaMask.data(), alphaMask.size());
+  return hasher.finish();
+}
+
+void GIFEncoder::encodeCached(const CachedFrame &frame)
+{
+  auto t1 = chrono::high_resolution_clock::now();
+  stats.localPalette = !firstFrame;
+  stats.learnMs = 0;
+  stats.histogramMs = 0;
+  stats.samples = 0;
+  stats.warm = false;
+  stats.paletteError = 0;
+  stats.mapMs = 0;
+  copy(frame.palette.begin(), frame.palette.end(), colorTab.begin());
+
+  if (optimizeLevel == 0 && !frame.data.empty())
+  {
+    colorDepth = 8;
+    palSize = 7;
+    transIndex = frame.transIndex;
+    writeFrame(&frame.data);
+    return;
+  }
+
+  // the optimizer needs the indices, only training is saved
+  PerfSample p = beginStage();
+  paletteIndex.build(colorTab.data(), 256);
+  mapPixels(paletteIndex, false);
+  applyTransparency();
+  endStage(STAGE_MAP, p);
+  stats.mapMs = elapsedMs(t1);
+  writeFrame();
+}
+
+void GIFEncoder::writeFrame(const vector<unsigned char> *pixelData)
+{
+  // a region is written as given, the caller already found what changed
+  if (optimizeLevel > 0 && !partialFrame())
+  {
+    writeSmallestFrame();
+    firstFrame = false;
+    return;
+  }
+
+  // the previous frame stays buffered until here, see mergeDuplicate
+  out.flush(); // keeps memory bounded when writing to a file
+  wholeFrame();
+  if (optimizeLevel == 0)
+    haveCanvas = false;
+  stats.candidates = 0;
+  writeFrameHeader();
+
+  auto t1 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  pixelDataPos = out.data.size();
+  if (pixelData != nullptr)
+    out.data.insert(out.data.end(), pixelData->begin(), pixelData->end());
+  else
+    writePixels(); // encode and write pixel data
+  if (optimizeLevel > 0)
+    trackRegion();
+  stats.lzwMs = elapsedMs(t1);
+  endStage(STAGE_LZW, p);
+
+  firstFrame = false;
+}
+
+void GIFEncoder::writeFrameHeader()
+{
+  auto t1 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  if (firstFrame)
+  {
+    writeLSD(); // logical screen descriptior
+    if (!globalIndex.empty())
+      out.data.insert(out.data.end(), globalTab.begin(), globalTab.end());
+    else
+      writePalette(); // global color table
+
+    // later frames may refer to it instead of a local table
+    screenTab = globalIndex.empty() ? colorTab : globalTab;
+    screenColors = globalIndex.empty() ? 2 << palSize : 256;
+    screenIndex.clear();
+    if (optimizeLevel >= 3)
+      screenIndex.build(screenTab.data(), screenColors);
+
+    if (repeat >= 0)
+    {
+      // use NS app extension to indicate reps
+      writeNetscapeExt();
+    }
+  }
+
+  writeGraphicCtrlExt(); // write graphic control extension
+  writeImageDesc(); // image descriptor
+  stats.rect = frameRect;
+
+  if (stats.localPalette)
+  {
+    writePalette(); // local color table
+  }
+  stats.writeMs = elapsedMs(t1);
+  endStage(STAGE_WRITE, p);
+}
+
+void GIFEncoder::wholeFrame()
+{
+  frameRect = region;
+  frameDisposal = defaultDisposal();
+  frameTransparent = false;
+}
+
+int GIFEncoder::defaultDisposal() const
+{
+  if (dispose >= 0)
+    return dispose & 7; // user override
+  // a region updates what is on screen and stays
+  if (partialFrame())
+    return 1;
+  // force clear if using transparent color, else no action
+  return transparent.has_value() ? 2 : 0;
+}
+
+// One way of writing the current frame, see writeSmallestFrame
+struct FrameCandidate
+{
+  enum Palette
+  {
+    FRAME,   // the frame's own indices and table
+    TRIMMED, // a local table of only the entries used
+    SCREEN   // the global color table
+  };
+
+  int previousDisposal = -1; // written for the last frame, -1 = none
+  FrameRect rect;
+  bool substitute = false; // pixels the screen already shows are transparent
+  Palette palette = FRAME;
+
+  array<int, GIFEncoder::colorTabLen> tab; // what the written indices refer to
+  int depth = 8;        // bits of the table
+  int trans = -1;       // transparent index, -1 = none
+  vector<char> indices; // the rect as a decoder will show it
+  ByteArray data;       // LZW image data
+  size_t bytes = SIZE_MAX; // with its extension, descriptor and table
+};
+
+void GIFEncoder::writeSmallestFrame()
+{
+  auto t1 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  int nPix = width * height;
+  bool clears = transparent.has_value(); // transIndex shows the background
+
+  // the screen before this frame when the last one is disposed with d
+  auto before = [this](int d, int x, int y) {
+    if (d < 0)
+      return -1;
+    if (d == 2 && x >= lastRect.x && x < lastRect.x + lastRect.width &&
+        y >= lastRect.y && y < lastRect.y + lastRect.height)
+      return -1;
+    return canvas[y * width + x];
+  };
+
+  // the picture the frame has to leave on screen, transparent pixels
+  // show what the last frame's disposal as written leaves
+  bool diff = haveCanvas && !firstFrame;
+  frameColors.resize(nPix);
+  for (int y = 0, i = 0; y < height; y++)
+  {
+    for (int x = 0; x < width; x++, i++)
+    {
+      int e = indexedPixels[i] & 0xff;
+      if (clears && e == transIndex)
+        frameColors[i] = before(diff ? lastDisposal : -1, x, y);
+      else
+        frameColors[i] = (colorTab[e * 3] << 16) | (colorTab[e * 3 + 1] << 8) | colorTab[e * 3 + 2];
+    }
+  }
+
+  // the last frame's disposal as written and, when a transparent color
+  // may need pixels cleared, the other one while it can still be patched
+  vector<int> disposals;
+  if (diff)
+  {
+    disposals.push_back(lastDisposal);
+    if (optimizeLevel >= 2 && clears && dispose < 0 && lastDelayPos > out.written)
+      disposals.push_back(lastDisposal == 2 ? 1 : 2);
+  }
+  else
+    disposals.push_back(-1);
+
+  vector<FrameCandidate::Palette> palettes;
+  if (firstFrame || !stats.localPalette)
+    palettes.push_back(FrameCandidate::FRAME);
+  else
+  {
+    palettes.push_back(FrameCandidate::TRIMMED);
+    // lossy matching may also pick close colours the frame doesn't use
+    if (stats.lossy > 0)
+      palettes.push_back(FrameCandidate::FRAME);
+    if (optimizeLevel >= 3 && !screenIndex.empty())
+      palettes.push_back(FrameCandidate::SCREEN);
+  }
+
+  vector<unique_ptr<FrameCandidate>> candidates;
+  FrameRect whole{0, 0, width, height};
+  bool wholeAdded = false;
+  for (size_t k = 0; k < disposals.size(); k++)
+  {
+    int d = disposals[k];
+
+    // what changed, and whether every transparent pixel still shows
+    // what it has to (no frame can change that, only the last one's
+    // disposal)
+    bool possible = true;
+    int x0 = width, y0 = height, x1 = -1, y1 = -1;
+    for (int y = 0; y < height && diff && possible; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        int color = frameColors[y * width + x];
+        int shown = before(d, x, y);
+        if (color == shown)
+          continue;
+        if (clears && (indexedPixels[y * width + x] & 0xff) == transIndex)
+        {
+          possible = false;
+          break;
+        }
+        x0 = min(x0, x);
+        x1 = max(x1, x);
+        y0 = min(y0, y);
+        y1 = max(y1, y);
+      }
+    }
+    // as written the frame stays whole, like an unoptimized one
+    if (!possible && (k > 0 || wholeAdded))
+      continue;
+
+    vector<FrameRect> rects{whole};
+    if (possible && diff && !clears)
+    {
+      FrameRect changed{0, 0, 1, 1}; // nothing changed, one pixel
+      if (x1 >= 0)
+        changed = FrameRect{x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+      if (changed.width < width || changed.height < height)
+        rects.push_back(changed);
+    }
+
+    for (const FrameRect &rect : rects)
+    {
+      for (int substitute = 0; substitute < (possible && diff && optimizeLevel >= 2 ? 2 : 1); substitute++)
+      {
+        // a whole opaque frame comes out the same for every disposal
+        bool same = &rect == &rects[0] && !substitute;
+        if (same && wholeAdded)
+          continue;
+        wholeAdded = wholeAdded || same;
+        for (FrameCandidate::Palette palette : palettes)
+        {
+          candidates.emplace_back(new FrameCandidate());
+          FrameCandidate &c = *candidates.back();
+          c.previousDisposal = d;
+          c.rect = rect;
+          c.substitute = substitute;
+          c.palette = palette;
+        }
+      }
+    }
+  }
+
+  runParallel(int(candidates.size()), [&](int n) {
+    FrameCandidate &c = *candidates[n];
+    const FrameRect &r = c.rect;
+
+    // pixels shown through the transparent index: those to clear and
+    // with substitution the ones already on screen
+    auto keeps = [&](int x, int y) {
+      int i = y * width + x;
+      if (clears && (indexedPixels[i] & 0xff) == transIndex)
+        return true;
+      return c.substitute && frameColors[i] == before(c.previousDisposal, x, y);
+    };
+
+    bitset<256> used;
+    bool transparency = clears;
+    for (int y = r.y; y < r.y + r.height; y++)
+    {
+      for (int x = r.x; x < r.x + r.width; x++)
+      {
+        if (keeps(x, y))
+          transparency = true;
+        else
+          used[indexedPixels[y * width + x] & 0xff] = true;
+      }
+    }
+
+    // table of the candidate and the index each entry of colorTab gets
+    int remap[256];
+    c.tab.fill(0);
+    if (c.palette == FrameCandidate::FRAME)
+    {
+      int entries = stats.localPalette ? 1 << colorDepth : screenColors;
+      c.tab = colorTab;
+      c.depth = colorDepth;
+      for (int e = 0; e < 256; e++)
+        remap[e] = e;
+      if (clears)
+        c.trans = transIndex;
+      for (int e = 0; e < entries && transparency && c.trans < 0; e++)
+      {
+        if (!used[e])
+          c.trans = e;
+      }
+    }
+    else if (c.palette == FrameCandidate::TRIMMED)
+    {
+      int count = 0;
+      for (int e = 0; e < 256; e++)
+      {
+        if (!used[e])
+          continue;
+        copy(colorTab.begin() + e * 3, colorTab.begin() + e * 3 + 3, c.tab.begin() + count * 3);
+        remap[e] = count++;
+      }
+      if (transparency)
+        c.trans = count < 256 ? count++ : -1;
+      // code sizes below 2 bits aren't allowed, keep as many entries
+      c.depth = 2;
+      while ((1 << c.depth) < count)
+        c.depth++;
+    }
+    else
+    {
+      // every entry used must be in the global table, each its own
+      c.tab = screenTab;
+      bitset<256> taken;
+      for (int e = 0; e < 256; e++)
+      {
+        if (!used[e])
+          continue;
+        int j = screenIndex.lookup(colorTab[e * 3], colorTab[e * 3 + 1], colorTab[e * 3 + 2]);
+        if (j < 0 || taken[j] || !equal(colorTab.begin() + e * 3, colorTab.begin() + e * 3 + 3, screenTab.begin() + j * 3))
+          return;
+        taken[j] = true;
+        remap[e] = j;
+      }
+      for (int j = 0; j < screenColors && transparency && c.trans < 0; j++)
+      {
+        if (!taken[j])
+          c.trans = j;
+      }
+    }
+    if (transparency && c.trans < 0)
+      return; // every index is taken
+
+    c.indices.resize(size_t(r.width) * r.height);
+    char *dst = c.indices.data();
+    for (int y = r.y; y < r.y + r.height; y++)
+    {
+      for (int x = r.x; x < r.x + r.width; x++)
+        *dst++ = keeps(x, y) ? c.trans : remap[indexedPixels[y * width + x] & 0xff];
+    }
+
+    LZWEncoder enc(r.width, r.height, c.indices.data(), c.depth);
+    enc.lossy = stats.lossy;
+    enc.palette = c.tab.data();
+    enc.deferReset = stats.deferReset;
+    enc.transparentIndex = c.trans;
+    enc.decoded = c.indices.data();
+    enc.encode(c.data);
+
+    c.bytes = c.data.data.size() + 8 + 10; // extension, descriptor
+    if (c.palette != FrameCandidate::SCREEN && stats.localPalette)
+      c.bytes += 3 << c.depth;
+  });
+
+  FrameCandidate *best = candidates[0].get();
+  for (auto &c : candidates)
+  {
+    if (c->bytes < best->bytes)
+      best = c.get();
+  }
+  stats.candidates = int(candidates.size());
+  stats.lzwMs = elapsedMs(t1);
+  endStage(STAGE_LZW, p);
+
+  // the screen this frame is drawn on
+  if (best->previousDisposal != lastDisposal && best->previousDisposal >= 0)
+  {
+    size_t pos = lastDelayPos - 1 - out.written; // packed fields of its extension
+    out.data[pos] = (out.data[pos] & ~0x1c) | (best->previousDisposal << 2);
+    lastDisposal = best->previousDisposal;
+  }
+  if (!diff)
+    canvas.assign(nPix, -1);
+  else if (lastDisposal == 2)
+  {
+    for (int y = lastRect.y; y < lastRect.y + lastRect.height; y++)
+    {
+      auto row = canvas.begin() + y * width + lastRect.x;
+      fill(row, row + lastRect.width, -1);
+    }
+  }
+
+  // the previous frame stays buffered until here, see mergeDuplicate
+  out.flush(); // keeps memory bounded when writing to a file
+
+  stats.localPalette = stats.localPalette && best->palette != FrameCandidate::SCREEN;
+  if (best->palette == FrameCandidate::TRIMMED)
+    colorTab = best->tab;
+  colorDepth = best->depth;
+  palSize = best->depth - 1;
+  transIndex = best->trans >= 0 ? best->trans : 0;
+  frameRect = best->rect;
+  frameDisposal = defaultDisposal();
+  frameTransparent = best->trans >= 0 && !clears;
+  writeFrameHeader();
+
+  t1 = chrono::high_resolution_clock::now();
+  p = beginStage();
+  out.data.insert(out.data.end(), best->data.data.begin(), best->data.data.end());
+
+  // what it leaves on screen
+  const FrameRect &r = best->rect;
+  const char *shown = best->indices.data();
+  for (int y = r.y; y < r.y + r.height; y++)
+  {
+    for (int x = r.x; x < r.x + r.width; x++)
+    {
+      int e = *shown++ & 0xff;
+      if (e != best->trans)
+        canvas[y * width + x] = (best->tab[e * 3] << 16) | (best->tab[e * 3 + 1] << 8) | best->tab[e * 3 + 2];
+    }
+  }
+  lastRect = r;
+  lastDisposal = frameDisposal;
+  // the screen to restore isn't kept, nor what an unknown screen showed
+  // through transparent pixels
+  haveCanvas = frameDisposal != 3 && (diff || firstFrame || !clears);
+  stats.lzwMs += elapsedMs(t1);
+  endStage(STAGE_LZW, p);
 }
 
-void GIFEncoder::finish()
+void GIFEncoder::trackRegion()
 {
-  out.writeByte(0x3b);
+  bool clears = transparent.has_value();
+  bool diff = haveCanvas && !firstFrame;
+  if (!diff && !firstFrame)
+    return; // nothing known around it
+
+  if (firstFrame)
+    canvas.assign(size_t(width) * height, -1);
+  else if (lastDisposal == 2)
+  {
+    for (int y = lastRect.y; y < lastRect.y + lastRect.height; y++)
+    {
+      auto row = canvas.begin() + y * width + lastRect.x;
+      fill(row, row + lastRect.width, -1);
+    }
+  }
+
+  // indexedPixels holds what a decoder shows, see writePixels
+  const char *shown = indexedPixels;
+  for (int y = region.y; y < region.y + region.height; y++)
+  {
+    for (int x = region.x; x < region.x + region.width; x++)
+    {
+      int e = *shown++ & 0xff;
+      if (!clears || e != transIndex)
+        canvas[y * width + x] = (colorTab[e * 3] << 16) | (colorTab[e * 3 + 1] << 8) | colorTab[e * 3 + 2];
+    }
+  }
+  lastRect = region;
+  lastDisposal = frameDisposal;
+  haveCanvas = frameDisposal != 3 && (diff || firstFrame || !clears);
 }
 
-void GIFEncoder::setRepeat(int r = 0)
+bool GIFEncoder::addOutputSize(int w, int h)
 {
-  repeat = r;
+  // the frames already written or held back have no scaled copies
+  if (!firstFrame || !pendingFrames.empty())
+    return false;
+  sizes.emplace_back(new GIFEncoder(w, h));
+  if (started)
+    sizes.back()->start();
+  return true;
 }
 
-void GIFEncoder::setQuality(int q)
+void GIFEncoder::encodeSizes()
 {
-  if (q < 1)
-    q = 1;
+  auto start = chrono::high_resolution_clock::now();
+  tuneForBudget();
+  for (int i = STAGE_LEARN; i < PERF_STAGES; i++)
+    stats.counters[i] = PerfSample();
+  stats.learnMs = 0;
+  stats.histogramMs = 0;
+  stats.samples = 0;
+  stats.warm = false;
+  stats.paletteError = 0;
 
-  sample = q;
+  // jobs of their own, so the mapping strips nested in them don't wait
+  // for the other sizes
+  TaskGroup jobs;
+  jobs.setPriority(tasks.priority());
+
+  // downscale every size from this frame
+  for (auto &size : sizes)
+  {
+    GIFEncoder *target = size.get();
+    target->tasks.setPriority(tasks.priority());
+    target->repeat = repeat;
+    target->delay = delay;
+    target->dispose = dispose;
+    target->optimizeLevel = optimizeLevel;
+    target->transparent = transparent;
+    target->stats.lossy = stats.lossy;
+    target->stats.deferReset = stats.deferReset;
+  }
+  jobs.parallel(int(sizes.size()), [this](int i) {
+    GIFEncoder *target = sizes[i].get();
+    scalePixels(pixels, width, height, target->pixels, target->width, target->height);
+    target->alphaMask.resize(alphaMask.empty() ? 0 : size_t(target->width) * target->height);
+    for (int y = 0; y < target->height && !alphaMask.empty(); y++)
+    {
+      int sy = (y * 2 + 1) * height / (target->height * 2);
+      for (int x = 0; x < target->width; x++)
+        target->alphaMask[size_t(y) * target->width + x] = alphaMask[size_t(sy) * width + (x * 2 + 1) * width / (target->width * 2)];
+    }
+  });
+
+  // one palette, trained on the smallest size
+  GIFEncoder *smallest = this;
+  for (auto &size : sizes)
+  {
+    if (size->pixLen < smallest->pixLen)
+      smallest = size.get();
+  }
+  trainPalette(smallest->pixels, smallest->pixLen);
+
+  // map and LZW encode every size in parallel, this one on index 0
+  array<int, colorTabLen> tab = colorTab;
+  jobs.parallel(int(sizes.size()) + 1, [this, &tab](int i) {
+    GIFEncoder *target = i == 0 ? this : sizes[i - 1].get();
+    target->encodeWithPalette(tab, paletteIndex);
+  });
+
+  stats.totalMs = elapsedMs(start) + stats.unpackMs;
+  updateCosts();
 }
 
-void GIFEncoder::setFrameRate(int fps)
+void GIFEncoder::encodeWithPalette(const array<int, colorTabLen> &tab, const PaletteIndex &index)
 {
-  delay = round(100 / fps);
+  size_t startBytes = out.size();
+
+  auto t1 = chrono::high_resolution_clock::now();
+  colorTab = tab;
+  stats.localPalette = !firstFrame;
+  mapPixels(index, false);
+  applyTransparency();
+  stats.mapMs = elapsedMs(t1);
+
+  writeFrame();
+  stats.bytes = out.size() - startBytes;
 }
 
-void GIFEncoder::addFrame(char* frame)
+void GIFEncoder::getImagePixels()
 {
-  image = frame;
+  unpackPixels(image, imageDesc, region.width, region.height, pixels);
 
-  auto t1 = chrono::high_resolution_clock::now();
-  getImagePixels(); // convert to correct format if necessary
-  auto t2 = chrono::high_resolution_clock::now();
+  // remember fully transparent pixels, they get the transparent index
+  int alpha = imageDesc.alphaOffset();
+  if (!transparent.has_value() || alpha < 0)
+  {
+    alphaMask.clear();
+    return;
+  }
 
-  // cout << "getImagePixels: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  alphaMask.resize(region.width * region.height);
+  int stride = imageDesc.rowStride(region.width);
+  for (int y = 0; y < region.height; y++)
+  {
+    const char *row = image + (long)y * stride + alpha;
+    for (int x = 0; x < region.width; x++)
+      alphaMask[y * region.width + x] = row[x * 4] == char(0);
+  }
+}
 
-  t1 = chrono::high_resolution_clock::now();
-  analyzePixels(); // build color table & map pixels
-  t2 = chrono::high_resolution_clock::now();
+bool GIFEncoder::setPalette(const unsigned char *rgb, int colors)
+{
+  if (!firstFrame || colors < 0 || colors > 256)
+    return false;
 
-  // cout << "analyzePixels: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  fixedPalette = colors > 0;
+  globalTab.fill(0);
+  globalIndex.clear();
+  if (!fixedPalette)
+    return true;
 
-  if (firstFrame)
+  copy(rgb, rgb + colors * 3, globalTab.begin());
+  globalIndex.build(globalTab.data(), colors);
+  globalPaletteFrames = 0;
+  maxPaletteError = 0;
+  return true;
+}
+
+bool GIFEncoder::addFrameRows(char *rows, int count, const FrameDescriptor &desc, string &error)
+{
+  if (rowEncoder == nullptr)
   {
-    t1 = chrono::high_resolution_clock::now();
-    writeLSD(); // logical screen descriptior
-    t2 = chrono::high_resolution_clock::now();
+    if (globalIndex.empty())
+    {
+      error = "Streaming rows needs a fixed or trained global palette";
+      return false;
+    }
+    if (!sizes.empty())
+    {
+      error = "Streaming rows doesn't support extra output sizes";
+      return false;
+    }
+  }
+  if (count <= 0 || count > height - rowsDone)
+  {
+    error = "Row count doesn't fit the rest of the frame";
+    return false;
+  }
 
-    // cout << "writeLSD: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  auto t1 = chrono::high_resolution_clock::now();
+  if (rowEncoder == nullptr)
+  {
+    // the frame's headers go out before any of its pixels
+    out.flush();
+    rowFrameStart = out.size();
+    stats = FrameStats();
+    tuneForBudget();
+    stats.histogram = false; // nothing is trained
+    stats.perf = perf.enabled();
+    stats.localPalette = false;
+    haveLastFrame = false; // nothing to compare the next frame with
 
-    t1 = chrono::high_resolution_clock::now();
-    writePalette(); // global color table
-    t2 = chrono::high_resolution_clock::now();
-    // cout << "writePalette: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
-    if (repeat >= 0)
+    colorTab = globalTab;
+    colorDepth = 8;
+    palSize = 7;
+    if (transparent.has_value())
     {
-      t1 = chrono::high_resolution_clock::now();
-      // use NS app extension to indicate reps
-      writeNetscapeExt();
-      t2 = chrono::high_resolution_clock::now();
+      // the pixels aren't known yet, any entry may be the closest
+      int c = transparent.value();
+      int index = globalIndex.lookup((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+      transIndex = index < 0 ? 0 : index;
+    }
 
-      // cout << "writeNetscapeExt: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+    wholeFrame();
+    haveCanvas = false; // the rows aren't kept
+    writeFrameHeader();
+    firstFrame = false;
+    rowEncoder.reset(new LZWEncoder(width, height, nullptr, colorDepth));
+    rowEncoder->lossy = stats.lossy;
+    rowEncoder->palette = colorTab.data();
+    rowEncoder->deferReset = stats.deferReset;
+    rowEncoder->transparentIndex = transparent.has_value() ? transIndex : -1;
+    rowEncoder->begin(out);
+  }
+
+  // unpack only this chunk into the start of the frame buffers
+  PerfSample p = beginStage();
+  auto t2 = chrono::high_resolution_clock::now();
+  int nPix = count * width;
+  unpackPixels(rows, desc, width, count, pixels);
+  int alpha = desc.alphaOffset();
+  alphaMask.clear();
+  if (transparent.has_value() && alpha >= 0)
+  {
+    alphaMask.resize(nPix);
+    int stride = desc.rowStride(width);
+    for (int y = 0; y < count; y++)
+    {
+      const char *row = rows + (long)y * stride + alpha;
+      for (int x = 0; x < width; x++)
+        alphaMask[y * width + x] = row[x * 4] == char(0);
     }
   }
+  if (!overlay.empty())
+    overlay.apply(pixels, width, alphaMask, rowsDone, count);
+  stats.unpackMs += elapsedMs(t2);
+  endStage(STAGE_UNPACK, p);
 
-  t1 = chrono::high_resolution_clock::now();
-  writeGraphicCtrlExt(); // write graphic control extension
+  p = beginStage();
   t2 = chrono::high_resolution_clock::now();
+  mapPixels(globalIndex, false, nPix);
+  for (size_t i = 0; i < alphaMask.size(); i++)
+  {
+    if (alphaMask[i])
+      indexedPixels[i] = transIndex;
+  }
+  stats.mapMs += elapsedMs(t2);
+  endStage(STAGE_MAP, p);
 
-  // cout << "writeGraphicCtrlExt: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
-
-  t1 = chrono::high_resolution_clock::now();
-  writeImageDesc(); // image descriptor
+  p = beginStage();
   t2 = chrono::high_resolution_clock::now();
+  rowEncoder->feed(indexedPixels, nPix, out);
+  rowsDone += count;
+  if (rowsDone == height)
+  {
+    rowEncoder->end(out);
+    rowEncoder.reset();
+    rowsDone = 0;
+  }
+  stats.lzwMs += elapsedMs(t2);
+  endStage(STAGE_LZW, p);
+
+  out.flush(); // written as it goes when streaming to a file
+  stats.totalMs += elapsedMs(t1);
+  if (rowEncoder == nullptr)
+  {
+    stats.bytes = out.size() - rowFrameStart;
+    updateCosts();
+  }
+  return true;
+}
 
-  // cout << "writeImageDesc: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+bool GIFEncoder::addIndexedFrame(const char *indices, int stride, const unsigned char *rgb, int colors, int transparentIndex, string &error)
+{
+  if (rowEncoder != nullptr)
+  {
+    error = "The frame of addFrameRows is incomplete";
+    return false;
+  }
+  if (!sizes.empty())
+  {
+    error = "Indexed frames can't be scaled to extra output sizes";
+    return false;
+  }
+  if (colors < 1 || colors > 256 || transparentIndex >= colors)
+  {
+    error = "The palette must hold 1 to 256 colors, the transparent index among them";
+    return false;
+  }
+  if (stride == 0)
+    stride = width;
+  if (stride < width)
+  {
+    error = "Stride is smaller than a row";
+    return false;
+  }
 
-  if (!firstFrame)
+  // check the indices before any state changes, noting the entries used
+  auto t1 = chrono::high_resolution_clock::now();
+  bool seen[256] = {false};
+  for (int y = 0; y < height; y++)
   {
+    const unsigned char *row = reinterpret_cast<const unsigned char *>(indices) + (long)y * stride;
+    for (int x = 0; x < width; x++)
+      seen[row[x]] = true;
+  }
+  for (int e = colors; e < 256; e++)
+  {
+    if (seen[e])
+    {
+      error = "Frame has indices outside the palette";
+      return false;
+    }
+  }
+  double checkMs = elapsedMs(t1);
 
-    t1 = chrono::high_resolution_clock::now();
-    writePalette(); // local color table
-    t2 = chrono::high_resolution_clock::now();
+  // held back frames come first, they use the same buffers
+  if (!pendingFrames.empty())
+    flushPendingFrames();
+
+  size_t startBytes = out.size();
+  stats = FrameStats();
+  auto t2 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  for (int y = 0; y < height; y++)
+    memcpy(indexedPixels + (long)y * width, indices + (long)y * stride, width);
+  usedEntry.reset();
+  for (int e = 0; e < colors; e++)
+    usedEntry[e] = seen[e];
+  endStage(STAGE_MAP, p);
+
+  tuneForBudget();
+  stats.histogram = false; // nothing is trained
+  stats.perf = perf.enabled();
+  stats.mapMs = checkMs + elapsedMs(t2);
+  haveLastFrame = false; // duplicates are found on RGB
 
-    // cout << "writePalette: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  colorTab.fill(0);
+  copy(rgb, rgb + colors * 3, colorTab.begin());
+  colorDepth = 1;
+  while ((1 << colorDepth) < colors)
+    colorDepth++;
+  palSize = colorDepth - 1;
+
+  // a first frame in global palette mode gives the global palette
+  if (firstFrame && globalIndex.empty() && globalPaletteFrames > 0)
+  {
+    globalTab = colorTab;
+    globalIndex.build(globalTab.data(), colors);
   }
-  t1 = chrono::high_resolution_clock::now();
-  writePixels(); // encode and write pixel data
-  t2 = chrono::high_resolution_clock::now();
+  const array<int, colorTabLen> &screen = firstFrame ? globalTab : screenTab;
+  bool onScreen = firstFrame ? !globalIndex.empty() : colors <= screenColors;
+  stats.localPalette = !(firstFrame && globalIndex.empty()) &&
+                       !(onScreen && equal(colorTab.begin(), colorTab.begin() + colors * 3, screen.begin()));
+
+  // the index stands in for the transparent color while the frame is written
+  boost::optional<int> colorKey = transparent;
+  if (transparentIndex >= 0)
+  {
+    transIndex = transparentIndex;
+    int k = transparentIndex * 3;
+    transparent = (colorTab[k] << 16) | (colorTab[k + 1] << 8) | colorTab[k + 2];
+  }
+  else if (transparent.has_value())
+    transIndex = findClosest(transparent.value());
 
-  //******** cout << "writePixels: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  writeFrame();
+  transparent = colorKey;
 
-  firstFrame = false;
+  stats.totalMs = elapsedMs(t1);
+  stats.bytes = out.size() - startBytes;
+  // its costs don't fit the model of quantized frames, only the budget
+  spentMs += stats.totalMs;
+  frameCount++;
+  return true;
 }
 
-void GIFEncoder::getImagePixels()
+FrameEstimate GIFEncoder::estimate(char *frame, const FrameDescriptor &desc, double fraction, bool first)
 {
-  int k = 0;
-  for (int i = 0; i < height; i++)
+  FrameEstimate result;
+  int nPix = width * height;
+  if (nPix == 0)
+    return result;
+
+  // evenly spread bands, or the whole frame as one band if they'd cover it
+  fraction = fraction > 0 ? min(fraction, 1.0) : 0; // NaN too
+  int bandRows = min(estimateBandRows, height);
+  int bands = max(estimateMinBands, int(height * fraction / bandRows + 0.5));
+  if (fraction >= 1 || bands * bandRows >= height)
+  {
+    bands = 1;
+    bandRows = height;
+  }
+  int sampleRows = bands * bandRows;
+  int samplePix = sampleRows * width;
+  double scale = double(nPix) / samplePix;
+  result.sampledRows = sampleRows;
+
+  auto t1 = chrono::high_resolution_clock::now();
+  vector<char> rgb(size_t(samplePix) * 3);
+  vector<char> mask;
+  int alpha = desc.alphaOffset();
+  bool masked = transparent.has_value() && alpha >= 0;
+  if (masked)
+    mask.resize(samplePix);
+  int stride = desc.rowStride(width);
+  vector<char> bandMask;
+  for (int b = 0; b < bands; b++)
+  {
+    int top = bands == 1 ? 0 : min(height - bandRows, max(0, int((b + 0.5) * height / bands) - bandRows / 2));
+    char *dst = &rgb[size_t(b) * bandRows * width * 3];
+    unpackPixels(frame + (long)top * stride, desc, width, bandRows, dst);
+    bandMask.clear();
+    if (masked)
+    {
+      bandMask.resize(size_t(bandRows) * width);
+      for (int y = 0; y < bandRows; y++)
+      {
+        const char *row = frame + (long)(top + y) * stride + alpha;
+        for (int x = 0; x < width; x++)
+          bandMask[y * width + x] = row[x * 4] == char(0);
+      }
+    }
+    if (!overlay.empty())
+      overlay.apply(dst, width, bandMask, top, bandRows);
+    if (masked)
+      copy(bandMask.begin(), bandMask.end(), mask.begin() + size_t(b) * bandRows * width);
+  }
+  double unpackMs = elapsedMs(t1);
+
+  // palette: the global one, or trained on the bands like trainPalette
+  array<int, colorTabLen> tab;
+  PaletteIndex trainedIndex;
+  const PaletteIndex *index = &globalIndex;
+  double learnMs = 0, histogramMs = 0, indexMs = 0;
+  bool local = globalIndex.empty();
+  if (local)
+  {
+    t1 = chrono::high_resolution_clock::now();
+    char *trainPixels = rgb.data();
+    TypedNeuQuant quant(trainPixels, sample, samplePix * 3);
+    quant.useHistogram = histogramQuantizer;
+    quant.threads = quantizerThreads;
+    quant.tasks = &tasks;
+    quant.buildColormap();
+    quant.getColormap(tab);
+    double trainMs = elapsedMs(t1);
+
+    auto t2 = chrono::high_resolution_clock::now();
+    trainedIndex.build(tab.data(), 256);
+    indexMs = elapsedMs(t2);
+    index = &trainedIndex;
+
+    // the learning loop scales with its sample count, the histogram pass
+    // with the pixels
+    histogramMs = histogramQuantizer ? quant.histogramMs + (nPix - samplePix) * histogramCost : 0;
+    int fullSamples = nPix / sample;
+    if (histogramQuantizer)
+      fullSamples = min(fullSamples, int(quant.histWeights.size()) * TypedNeuQuant::histogramSamples);
+    learnMs = (trainMs - quant.histogramMs) * fullSamples / max(1, quant.samples);
+  }
+  else
+    tab = globalTab;
+
+  t1 = chrono::high_resolution_clock::now();
+  vector<char> indices(samplePix);
+  int last = -1;
+  int entry = 0;
+  for (int j = 0, k = 0; j < samplePix; j++, k += 3)
   {
-    for (int j = 0; j < width; j++)
+    int r = rgb[k] & 0xff;
+    int g = rgb[k + 1] & 0xff;
+    int b = rgb[k + 2] & 0xff;
+    int color = (r << 16) | (g << 8) | b;
+    if (color != last)
     {
-      int b = (i * width * 4) + j * 4;
+      entry = index->lookup(r, g, b);
+      last = color;
+    }
+    indices[j] = entry;
+  }
+  int trans = -1;
+  if (transparent.has_value())
+  {
+    int c = transparent.value();
+    trans = max(0, index->lookup((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff));
+  }
+  if (masked)
+  {
+    for (int j = 0; j < samplePix; j++)
+    {
+      if (mask[j])
+        indices[j] = trans;
+    }
+  }
+  double mapMs = elapsedMs(t1);
+
+  // compress the bands back to back, noting the bits each one took
+  t1 = chrono::high_resolution_clock::now();
+  ByteArray scratch;
+  LZWEncoder enc(width, sampleRows, nullptr, 8);
+  enc.lossy = lossy;
+  enc.palette = tab.data();
+  enc.deferReset = deferReset;
+  enc.transparentIndex = trans;
+  enc.begin(scratch);
+  // the first row of every band only rebuilds context after the seam,
+  // the rate of the others stands for the rows not sampled
+  vector<double> bandBits(bands);
+  int bandPix = bandRows * width;
+  double firstBits = 0;
+  for (int b = 0; b < bands; b++)
+  {
+    const char *band = &indices[size_t(b) * bandPix];
+    long before = enc.out_bits;
+    enc.feed(band, width, scratch);
+    long seam = enc.out_bits;
+    enc.feed(band + width, bandPix - width, scratch);
+    if (b == 0)
+      firstBits = double(enc.out_bits - before);
+    bandBits[b] = double(enc.out_bits - seam);
+  }
+  long sampleBits = enc.out_bits;
+  bool filled = enc.clear_in > 0 || enc.free_ent >= 1 << BITS;
+  enc.end(scratch);
+  double lzwMs = elapsedMs(t1);
+
+  double bits = firstBits;
+  int ratePix = max(1, bandPix - width);
+  double rate = bandRows > 1 ? bandBits[0] / ratePix : firstBits / bandPix;
+  double spread = 0;
+  if (bands > 1)
+  {
+    double tail = 0;
+    for (int b = 1; b < bands; b++)
+      tail += bandBits[b];
+    rate = tail / (double(bands - 1) * ratePix);
+    for (int b = 1; b < bands; b++)
+      spread += (bandBits[b] / ratePix - rate) * (bandBits[b] / ratePix - rate);
+    spread = sqrt(spread / max(1, bands - 2));
+  }
+  bits += rate * (nPix - bandPix);
 
-      pixels[k++] = image[b];
-      pixels[k++] = image[b + 1];
-      pixels[k++] = image[b + 2];
+  // A table that never filled means long repeats. Their codes grow like
+  // the square root of the pixels (strings get one pixel longer per code)
+  // up to linearly, so take the middle and widen the bound to both ends.
+  double growthError = 0;
+  if (!filled && bands > 1)
+  {
+    double root = sampleBits * sqrt(scale);
+    if (root < bits)
+    {
+      double middle = sqrt(bits * root);
+      growthError = bits / middle - 1;
+      bits = middle;
     }
   }
+
+  // data bytes, their sub-block lengths, code size and terminator
+  double data = ceil(bits / 8);
+  result.bytes = data + ceil(data / 255) + 2;
+  result.bytes += 8 + 10; // graphic control extension, image descriptor
+  if (first)
+    result.bytes += 6 + 7 + 768 + (repeat >= 0 ? 19 : 0);
+  else if (local)
+    result.bytes += 768;
+
+  // two standard errors of the mean band rate, shrunk by the share of
+  // rows sampled, plus what the sampled palette and band seams add
+  double sampled = double(sampleRows) / height;
+  result.bytesError = bands > 2 && rate > 0 ? 2 * spread / rate / sqrt(double(bands - 1)) * sqrt(1 - sampled) : 0;
+  result.bytesError += bands > 1 ? estimateBiasError + growthError : 0;
+
+  result.ms = (unpackMs + mapMs + lzwMs) * scale + histogramMs + learnMs + indexMs;
+  // timing a few bands says little about scheduling or cache effects on
+  // the whole frame, so the time bound is a fixed figure, not measured
+  result.msError = estimateTimeError;
+  return result;
 }
 
 void GIFEncoder::writePixels()
 {
-  LZWEncoder enc = LZWEncoder(width, height, indexedPixels, colorDepth);
+  LZWEncoder enc = LZWEncoder(region.width, region.height, indexedPixels, colorDepth);
+  enc.lossy = stats.lossy;
+  enc.palette = colorTab.data();
+  enc.deferReset = stats.deferReset;
+  // lossy matching must neither punch holes nor fill them
+  enc.transparentIndex = transparent.has_value() ? transIndex : -1;
+  // a region tracked on the canvas needs what a decoder shows
+  if (optimizeLevel > 0)
+    enc.decoded = indexedPixels;
 
   enc.encode(out);
 }
 
 void GIFEncoder::analyzePixels()
 {
-  int len = pixLen;
-  int nPix = len / 3;
-  TypedNeuQuant imgq(pixels, sample, pixLen);
-
   auto t1 = chrono::high_resolution_clock::now();
-  imgq.buildColormap(); // create reduced palette
-  auto t2 = chrono::high_resolution_clock::now();
+  stats.localPalette = !firstFrame;
+  stats.learnMs = 0;
+  stats.histogramMs = 0;
+  stats.samples = 0;
+  stats.warm = false;
 
-  // cout << "buildColormap: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  bool mapped = false;
+  if (!globalIndex.empty())
+  {
+    PerfSample p = beginStage();
+    colorTab = globalTab;
+    stats.paletteError = mapPixels(globalIndex, maxPaletteError > 0);
+    stats.localPalette = false;
+    mapped = maxPaletteError <= 0 || stats.paletteError <= maxPaletteError;
+    if (!mapped)
+      stats.localPalette = true; // too far off, train a table for this frame
+    endStage(STAGE_MAP, p);
+  }
+  stats.mapMs = elapsedMs(t1);
 
-  t1 = chrono::high_resolution_clock::now();
-  imgq.getColormap(colorTab);
-  t2 = chrono::high_resolution_clock::now();
+  if (!mapped)
+  {
+    trainPalette(pixels, pixLen);
 
-  // cout << "getColormap: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+    t1 = chrono::high_resolution_clock::now();
+    PerfSample p = beginStage();
+    mapPixels(paletteIndex, false);
+    stats.mapMs += elapsedMs(t1);
+    endStage(STAGE_MAP, p);
+  }
 
   t1 = chrono::high_resolution_clock::now();
-  // map image pixels to new palette
-  int k = 0;
-  for (int j = 0; j < nPix; j++)
+  applyTransparency();
+  stats.mapMs += elapsedMs(t1);
+}
+
+void GIFEncoder::trainPalette(char *trainPixels, int trainLen)
+{
+  TypedNeuQuant imgq(trainPixels, stats.sample, trainLen);
+  imgq.useHistogram = stats.histogram;
+  imgq.threads = quantizerThreads;
+  imgq.tasks = perf.enabled() ? nullptr : &tasks; // see runParallel
+  imgq.ncycles = stats.cycles;
+  imgq.perf = &perf;
+
+  stats.warm = warmStart && warmNetwork[0].size() > 0 &&
+               (keyframeInterval == 0 || warmFrames < keyframeInterval);
+  if (stats.warm)
   {
-    int index = imgq.lookupRGB(
-        pixels[k++] & 0xff,
-        pixels[k++] & 0xff,
-        pixels[k++] & 0xff);
+    imgq.warmNetwork = warmNetwork;
+    warmFrames++;
+  }
+  else
+    warmFrames = 0;
 
-    usedEntry[index] = true;
-    indexedPixels[j] = index;
+  auto t1 = chrono::high_resolution_clock::now();
+  PerfSample p = beginStage();
+  imgq.buildColormap(); // create reduced palette
+  imgq.getColormap(colorTab);
+  paletteIndex.build(colorTab.data(), 256);
+  stats.learnMs = elapsedMs(t1);
+  endStage(STAGE_LEARN, p);
+  stats.counters[STAGE_INXBUILD] = imgq.inxbuildCounters;
+  if (warmStart)
+  {
+    for (int i = 0; i < 3; i++)
+      warmNetwork[i] = imgq.learned[i];
   }
-  t2 = chrono::high_resolution_clock::now();
-  // ********* cout << "lookupRGB: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  stats.samples = imgq.samples;
+  stats.histogramMs = stats.histogram ? imgq.histogramMs : 0;
+  if (stats.histogram)
+    histogramBins = max(1, int(imgq.histWeights.size()));
+}
 
+void GIFEncoder::applyTransparency()
+{
   colorDepth = 8;
   palSize = 7;
 
   // get closest match to transparent color if specified
   if (transparent.has_value())
   {
-    t1 = chrono::high_resolution_clock::now();
     transIndex = findClosest(transparent.value());
-    t2 = chrono::high_resolution_clock::now();
-    cout << "findClosest: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
 
-    t1 = chrono::high_resolution_clock::now();
     // ensure that pixels with full transparency in the RGBA image are using the selected transparent color index in the indexed image.
-    for (int pixelIndex = 0; pixelIndex < nPix; pixelIndex++)
+    for (size_t i = 0; i < alphaMask.size(); i++)
+    {
+      if (alphaMask[i])
+        indexedPixels[i] = transIndex;
+    }
+  }
+}
+
+double GIFEncoder::mapPixels(const PaletteIndex &index, bool measureError, int count)
+{
+  int nPix = count < 0 ? pixLen / 3 : count;
+
+  // large frames are mapped in strips on the thread pool
+  int strips = max(1, min(ThreadPool::shared().size() + 1, nPix / mapStripPixels));
+  vector<bitset<256>> used(strips);
+  vector<long> errors(strips, 0);
+
+  runParallel(strips, [&](int s) {
+    int from = int(int64_t(nPix) * s / strips);
+    int to = int(int64_t(nPix) * (s + 1) / strips);
+    bitset<256> &stripUsed = used[s];
+    long error = 0;
+
+    // map image pixels to new palette, runs of one colour reuse the last match
+    int last = -1;
+    int entry = 0;
+    int k = from * 3;
+    for (int j = from; j < to; j++)
     {
-      if (image[pixelIndex * 4 + 3] == char(0))
+      int r = pixels[k] & 0xff;
+      int g = pixels[k + 1] & 0xff;
+      int b = pixels[k + 2] & 0xff;
+      k += 3;
+
+      int color = (r << 16) | (g << 8) | b;
+      if (color != last)
+      {
+        entry = index.lookup(r, g, b);
+        last = color;
+      }
+
+      stripUsed[entry] = true;
+      indexedPixels[j] = entry;
+
+      if (measureError)
       {
-        indexedPixels[pixelIndex] = transIndex;
+        int dr = r - colorTab[entry * 3];
+        int dg = g - colorTab[entry * 3 + 1];
+        int db = b - colorTab[entry * 3 + 2];
+        error += dr * dr + dg * dg + db * db;
       }
     }
-    t2 = chrono::high_resolution_clock::now();
-    cout << "ensure transparent: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+    errors[s] = error;
+  });
+
+  usedEntry.reset();
+  long error = 0;
+  for (int s = 0; s < strips; s++)
+  {
+    usedEntry |= used[s];
+    error += errors[s];
   }
+  return nPix > 0 ? double(error) / nPix : 0;
 }
 
 /*
@@ -214,25 +1918,17 @@ int GIFEncoder::findClosest(int c)
   int r = (c & 0xFF0000) >> 16;
   int g = (c & 0x00FF00) >> 8;
   int b = (c & 0x0000FF);
-  int minpos = 0;
-  int dmin = int(256 * 256 * 256);
-  int len = colorTabLen;
-
-  for (int i = 0; i < len;)
-  {
-    int index = i / 3;
-    int dr = r - (colorTab[i++] & 0xff);
-    int dg = g - (colorTab[i++] & 0xff);
-    int db = b - (colorTab[i++] & 0xff);
-    int d = dr * dr + dg * dg + db * db;
-    if (usedEntry[index] && (d < dmin))
-    {
-      dmin = d;
-      minpos = index;
-    }
-  }
 
-  return minpos;
+  // only entries the frame actually uses are candidates, the index is
+  // kept for as long as the palette and its used entries stay the same
+  if (usedIndex.empty() || usedIndexMask != usedEntry || usedIndexTab != colorTab)
+  {
+    usedIndex.build(colorTab.data(), colorTabLen / 3, &usedEntry);
+    usedIndexTab = colorTab;
+    usedIndexMask = usedEntry;
+  }
+  int index = usedIndex.lookup(r, g, b);
+  return index < 0 ? 0 : index;
 };
 
 /*
@@ -249,7 +1945,7 @@ void GIFEncoder::writeLSD()
       0x80 |  // 1 : global color table flag = 1 (gct used)
       0x70 |  // 2-4 : color resolution = 7
       0x00 |  // 5 : gct sort flag = 0
-      palSize // 6-8 : gct size
+      (globalIndex.empty() ? palSize : 7) // 6-8 : gct size, a global palette is whole
   );
 
   out.writeByte(0); // background color index
@@ -264,10 +1960,8 @@ void GIFEncoder::writeShort(int pValue)
 
 void GIFEncoder::writePalette()
 {
-  out.data.insert(out.data.end(), colorTab.begin(), colorTab.end());
-  int n = (3 * 256) - colorTabLen;
-  for (int i = 0; i < n; i++)
-    out.writeByte(0);
+  // 2 << palSize entries, all of colorTab unless a frame's table is trimmed
+  out.data.insert(out.data.end(), colorTab.begin(), colorTab.begin() + (3 << (palSize + 1)));
 }
 
 /*
@@ -294,23 +1988,8 @@ void GIFEncoder::writeGraphicCtrlExt()
   out.writeByte(0xf9); // GCE label
   out.writeByte(4);    // data block size
 
-  int transp, disp;
-  if (!transparent.has_value())
-  {
-    transp = 0;
-    disp = 0; // dispose = no action
-  }
-  else
-  {
-    transp = 1;
-    disp = 2; // force clear if using transparent color
-  }
-
-  if (dispose >= 0)
-  {
-    disp = dispose & 7; // user override
-  }
-  disp <<= 2;
+  int transp = transparent.has_value() || frameTransparent ? 1 : 0;
+  int disp = frameDisposal << 2; // see wholeFrame and writeSmallestFrame
 
   // packed fields
   out.writeByte(
@@ -320,6 +1999,8 @@ void GIFEncoder::writeGraphicCtrlExt()
       transp // 8 transparency flag
   );
 
+  lastDelayPos = out.size();
+  lastDelay = delay;
   writeShort(int(delay));    // delay x 1/100 sec
   out.writeByte(transIndex); // transparent color index
   out.writeByte(0);          // block terminator
@@ -331,13 +2012,13 @@ void GIFEncoder::writeGraphicCtrlExt()
 void GIFEncoder::writeImageDesc()
 {
   out.writeByte(0x2c); // image separator
-  writeShort(0);       // image position x,y = 0,0
-  writeShort(0);
-  writeShort(width); // image size
-  writeShort(height);
+  writeShort(frameRect.x); // image position
+  writeShort(frameRect.y);
+  writeShort(frameRect.width); // image size
+  writeShort(frameRect.height);
 
   // packed fields
-  if (firstFrame)
+  if (!stats.localPalette)
   {
     // no LCT - GCT is used for first (or only) frame
     out.writeByte(0);
@@ -21,6 +21,7 @@
 */
 
 #include "lzw-encoder.h"
+#include "algorithm"
 
 using namespace std;
 
@@ -47,47 +48,72 @@ pixels(p)
 LZWEncoder::~LZWEncoder() {}
 
 void LZWEncoder::encode(ByteArray &outs)
-
 {
-  outs.writeByte(initCodeSize); // write "initial code size" int
-  remaining = width * height;   // reset navigation variables
-  curPixel = 0;
-
-  compress(int(initCodeSize) + 1, outs); // compress and write the pixel data
-  outs.writeByte(int(0));                // write block terminator
+  begin(outs);
+  feed(pixels, width * height, outs);
+  end(outs);
 }
 
-void LZWEncoder::compress(int init_bits, ByteArray &outs)
+void LZWEncoder::begin(ByteArray &outs)
 {
-  int fcode, c, i, ent, disp, hsize_reg, hshift;
+  if (lossy > 0 && palette != nullptr)
+    buildNeighbours();
+
+  outs.writeByte(initCodeSize); // write "initial code size" int
+  curPixel = 0;                 // reset navigation variables
+  haveEnt = false;
 
   // Set up the globals: g_init_bits - initial number of bits
-  g_init_bits = init_bits;
+  g_init_bits = initCodeSize + 1;
 
   // Set up the necessary values
   clear_flg = false;
   n_bits = g_init_bits;
   maxcode = MAXCODE(n_bits);
 
-  ClearCode = 1 << (init_bits - 1);
+  ClearCode = 1 << (g_init_bits - 1);
   EOFCode = ClearCode + 1;
   free_ent = ClearCode + 2;
 
   a_count = 0; // clear packet
 
-  ent = int(nextPixel());
+  out_bits = 0;
+  checkpoint = CHECK_GAP;
+  window_in = 0;
+  window_out = 0;
+  clear_in = 0;
+  clear_out = 0;
+  last_ratio = 0;
+  ratio_drop = false;
 
+  int fcode;
   hshift = 0;
   for (fcode = HSIZE; fcode < 65536; fcode *= 2)
     ++hshift;
   hshift = 8 - hshift; // set hash code range bound
-  hsize_reg = HSIZE;
-  cl_hash(hsize_reg); // clear hash table
+  cl_hash(HSIZE);      // clear hash table
 
   output(ClearCode, outs);
+}
 
-  while ((c = int(nextPixel())) != EOF)
+void LZWEncoder::feed(const char *indices, int count, ByteArray &outs)
+{
+  int fcode, c, i, disp;
+  const int hsize_reg = HSIZE;
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(indices);
+  const unsigned char *last = p + count;
+
+  if (!haveEnt && p < last)
+  {
+    ent = *p++;
+    curPixel++;
+    haveEnt = true;
+  }
+
+  while (p < last)
   {
+    c = *p++;
+    curPixel++;
     fcode = (c << BITS) + ent;
     i = (c << hshift) ^ ent; // xor hashing
     if (htab[i] == fcode)
@@ -111,24 +137,53 @@ void LZWEncoder::compress(int init_bits, ByteArray &outs)
         }
       } while (htab[i] >= 0);
     }
+    if (lossy > 0 && palette != nullptr)
+    {
+      // no exact match, try to continue the string with a close colour
+      for (int k = 0; k < neighbourCount[c]; k++)
+      {
+        int code = lookup(ent, neighbours[c][k], hshift);
+        if (code >= 0)
+        {
+          ent = code;
+          if (decoded != nullptr)
+            decoded[curPixel - 1] = neighbours[c][k];
+          goto outer_loop;
+        }
+      }
+    }
     output(ent, outs);
     ent = c;
-    if (free_ent < 1 << BITS)
+    if (curPixel >= checkpoint)
+      check_ratio(curPixel);
+
+    if (ratio_drop && free_ent >= 1 << BITS)
+    {
+      cl_block(outs);
+    }
+    else if (free_ent < 1 << BITS)
     {
       codetab[i] = free_ent++; // code -> hashtable
       htab[i] = fcode;
+      if (free_ent == 1 << BITS)
+        fill_ratio = double(curPixel - clear_in) / double(out_bits - clear_out);
     }
-    else
+    else if (!deferReset)
     {
       cl_block(outs);
     }
 
   outer_loop:;
   }
+}
 
+void LZWEncoder::end(ByteArray &outs)
+{
   // Put out the final code.
-  output(ent, outs);
+  if (haveEnt)
+    output(ent, outs);
   output(EOFCode, outs);
+  outs.writeByte(int(0)); // write block terminator
 }
 
 // Flush the packet to disk, and reset the accumulator
@@ -166,6 +221,24 @@ void LZWEncoder::cl_block(ByteArray &outs)
   free_ent = ClearCode + 2;
   clear_flg = true;
   output(ClearCode, outs);
+  clear_in = curPixel;
+  clear_out = out_bits;
+  ratio_drop = false;
+}
+
+void LZWEncoder::check_ratio(int in_count)
+{
+  double ratio = double(in_count - window_in) / double(out_bits - window_out);
+
+  if (free_ent >= 1 << BITS)
+    ratio_drop = ratio < fill_ratio * DEFER_GAIN || ratio < last_ratio * DEFER_SLIP;
+  else
+    ratio_drop = false;
+  last_ratio = ratio;
+
+  window_in = in_count;
+  window_out = out_bits;
+  checkpoint = in_count + CHECK_GAP;
 }
 
 // Reset code table
@@ -175,14 +248,65 @@ void LZWEncoder::cl_hash(int hsize)
     htab[i] = -1;
 }
 
-// Return the next pixel from the image
-int LZWEncoder::nextPixel()
+int LZWEncoder::lookup(int ent, int c, int hshift)
+{
+  int fcode = (c << BITS) + ent;
+  int i = (c << hshift) ^ ent;
+  if (htab[i] == fcode)
+    return codetab[i];
+  if (htab[i] < 0)
+    return -1;
+
+  int disp = HSIZE - i;
+  if (i == 0)
+    disp = 1;
+  do
+  {
+    if ((i -= disp) < 0)
+      i += HSIZE;
+    if (htab[i] == fcode)
+      return codetab[i];
+  } while (htab[i] >= 0);
+
+  return -1;
+}
+
+// Weighted RGB distance, roughly tracking how visible the error is
+static int colorDistance(const int *a, const int *b)
+{
+  int dr = a[0] - b[0];
+  int dg = a[1] - b[1];
+  int db = a[2] - b[2];
+  return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
+void LZWEncoder::buildNeighbours()
 {
-  if (remaining == 0)
-    return int(EOF);
-  --remaining;
-  int pix = pixels[curPixel++];
-  return int(int(pix) & 0xff);
+  // lossy is expressed like gifsicle's level; level / 4 is the tolerated
+  // per-channel error, the weights above sum to 9
+  int maxError = lossy / 4;
+  int threshold = 9 * maxError * maxError;
+  int n = 1 << initCodeSize;
+  pair<int, int> candidates[256];
+
+  for (int a = 0; a < n; a++)
+  {
+    int count = 0;
+    for (int b = 0; b < n && a != transparentIndex; b++)
+    {
+      if (b == a || b == transparentIndex)
+        continue;
+      int d = colorDistance(&palette[a * 3], &palette[b * 3]);
+      if (d <= threshold)
+        candidates[count++] = make_pair(d, b);
+    }
+
+    int keep = min(count, LOSSY_CANDIDATES);
+    partial_sort(candidates, candidates + keep, candidates + count);
+    neighbourCount[a] = keep;
+    for (int k = 0; k < keep; k++)
+      neighbours[a][k] = candidates[k].second;
+  }
 }
 
 void LZWEncoder::output(int code, ByteArray &outs)
@@ -195,6 +319,7 @@ void LZWEncoder::output(int code, ByteArray &outs)
     cur_accum = code;
 
   cur_bits += n_bits;
+  out_bits += n_bits;
 
   while (cur_bits >= 8)
   {
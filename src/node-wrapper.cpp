@@ -1,9 +1,17 @@
 #include "node-wrapper.h"
+#include "decoder-wrapper.h"
 #include "node_buffer.h"
+#include "climits"
+#include "cmath"
+#include "cstring"
 
 namespace gifencoder
 {
+using v8::ArrayBuffer;
+using v8::ArrayBufferView;
+using v8::Boolean;
 using v8::Context;
+using v8::Exception;
 using v8::Function;
 using v8::FunctionCallbackInfo;
 using v8::FunctionTemplate;
@@ -13,14 +21,77 @@ using v8::NewStringType;
 using v8::Number;
 using v8::Object;
 using v8::ObjectTemplate;
+using v8::SharedArrayBuffer;
 using v8::String;
 using v8::Value;
 
-void NodeWrapper::Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module)
+char *FrameData(Local<Value> value, size_t &length)
+{
+  if (value->IsArrayBufferView())
+  {
+    Local<ArrayBufferView> view = value.As<ArrayBufferView>();
+    length = view->ByteLength();
+    return static_cast<char *>(view->Buffer()->GetBackingStore()->Data()) + view->ByteOffset();
+  }
+  if (value->IsArrayBuffer())
+  {
+    Local<ArrayBuffer> buffer = value.As<ArrayBuffer>();
+    length = buffer->ByteLength();
+    return static_cast<char *>(buffer->GetBackingStore()->Data());
+  }
+  if (value->IsSharedArrayBuffer())
+  {
+    Local<SharedArrayBuffer> buffer = value.As<SharedArrayBuffer>();
+    length = buffer->ByteLength();
+    return static_cast<char *>(buffer->GetBackingStore()->Data());
+  }
+  length = 0;
+  return nullptr;
+}
+
+/*
+  Reads the width and height arguments of the constructor and reset, 0
+  when missing. Throws and returns false unless both are 1 - 65535 (the
+  GIF limit) and, with 0 meaning keepW or keepH, cover at most
+  GIFEncoder::maxPixels.
+*/
+static bool ScreenSize(Isolate *isolate, Local<Value> w, Local<Value> h, int keepW, int keepH, int &width, int &height)
 {
-  Isolate *isolate = exports->GetIsolate();
   Local<Context> context = isolate->GetCurrentContext();
+  double dw = w->IsUndefined() ? 0 : w->NumberValue(context).FromMaybe(-1);
+  double dh = h->IsUndefined() ? 0 : h->NumberValue(context).FromMaybe(-1);
+  // NaN fails both comparisons
+  if (!(dw >= 0 && dw <= 65535 && dh >= 0 && dh <= 65535) ||
+      (dw > 0 ? size_t(dw) : size_t(keepW)) * (dh > 0 ? size_t(dh) : size_t(keepH)) > GIFEncoder::maxPixels)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Width and height must be 1 - 65535 and cover at most 2^28 pixels", NewStringType::kNormal).ToLocalChecked()));
+    return false;
+  }
+  width = int(dw);
+  height = int(dh);
+  return true;
+}
 
+NodeWrapper::~NodeWrapper()
+{
+  Isolate *isolate = Isolate::GetCurrent();
+  if (isolate != nullptr)
+    isolate->AdjustAmountOfExternalAllocatedMemory(-reportedBytes);
+}
+
+void NodeWrapper::ReportMemory(Isolate *isolate)
+{
+  int64_t bytes = int64_t(encoder.pixelCapacity) * 4;
+  isolate->AdjustAmountOfExternalAllocatedMemory(bytes - reportedBytes);
+  reportedBytes = bytes;
+}
+
+void NodeWrapper::Init(v8::Local<v8::Object> /* exports */, v8::Local<v8::Value> module, v8::Local<v8::Context> context)
+{
+  Isolate *isolate = context->GetIsolate();
+
+  // per-context addon data, holds the constructor for calls without `new`
   Local<ObjectTemplate> addon_data_tpl = ObjectTemplate::New(isolate);
   addon_data_tpl->SetInternalFieldCount(1);
   Local<Object> addon_data = addon_data_tpl->NewInstance(context).ToLocalChecked();
@@ -32,15 +103,43 @@ void NodeWrapper::Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> modu
 
   // prototype
   NODE_SET_PROTOTYPE_METHOD(tpl, "start", Start);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "reset", Reset);
   NODE_SET_PROTOTYPE_METHOD(tpl, "setRepeat", SetRepeat);
   NODE_SET_PROTOTYPE_METHOD(tpl, "setQuality", SetQuality);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setHistogramQuantizer", SetHistogramQuantizer);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setWarmStart", SetWarmStart);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setGlobalPalette", SetGlobalPalette);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setLossy", SetLossy);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setDeferredClear", SetDeferredClear);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setOptimize", SetOptimize);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setPerfCounters", SetPerfCounters);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setOverlay", SetOverlay);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setDuplicateFrames", SetDuplicateFrames);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setFrameCache", SetFrameCache);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setTimeBudget", SetTimeBudget);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "getFrameStats", GetFrameStats);
   NODE_SET_PROTOTYPE_METHOD(tpl, "setFrameRate", SetFrameRate);
   NODE_SET_PROTOTYPE_METHOD(tpl, "addFrame", AddFrame);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "addFrameRegion", AddFrameRegion);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "addFrameRows", AddFrameRows);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "addIndexedFrame", AddIndexedFrame);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "estimate", Estimate);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setPalette", SetPalette);
   NODE_SET_PROTOTYPE_METHOD(tpl, "finish", Finish);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setOutput", SetOutput);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "append", Append);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "addOutputSize", AddOutputSize);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "getOutput", GetOutput);
+  NODE_SET_PROTOTYPE_METHOD(tpl, "setPriority", SetPriority);
 
   Local<Function> constructor = tpl->GetFunction(context).ToLocalChecked();
-  // addon_data->SetInternalField(0, constructor);
-  module->Set(context, String::NewFromUtf8(isolate, "exports", NewStringType::kNormal).ToLocalChecked(), constructor).FromJust();
+  addon_data->SetInternalField(0, constructor);
+  // static, the pool is shared by every encoder in the process
+  NODE_SET_METHOD(constructor.As<Object>(), "setThreadPoolSize", SetThreadPoolSize);
+  NODE_SET_METHOD(constructor.As<Object>(), "setFrameCacheSize", SetFrameCacheSize);
+  NODE_SET_METHOD(constructor.As<Object>(), "getFrameCacheStats", GetFrameCacheStats);
+  DecoderWrapper::Init(constructor, context);
+  module.As<Object>()->Set(context, String::NewFromUtf8(isolate, "exports", NewStringType::kNormal).ToLocalChecked(), constructor).FromJust();
 };
 void NodeWrapper::New(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
@@ -50,12 +149,14 @@ void NodeWrapper::New(const v8::FunctionCallbackInfo<v8::Value> &args)
   if (args.IsConstructCall())
   {
     // invoked using `new`
-    int width = args[0]->IsUndefined() ? 0 : args[0]->NumberValue(context).FromMaybe(0);
-    int height = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+    int width, height;
+    if (!ScreenSize(isolate, args[0], args[1], 0, 0, width, height))
+      return;
 
     NodeWrapper *wrapper = new NodeWrapper(width, height);
 
     wrapper->Wrap(args.This());
+    wrapper->ReportMemory(isolate);
     args.GetReturnValue().Set(args.This());
   }
   else
@@ -77,6 +178,20 @@ void NodeWrapper::Start(const v8::FunctionCallbackInfo<v8::Value> &args)
   wrapper->encoder.start();
 };
 
+void NodeWrapper::Reset(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int width, height;
+  if (!ScreenSize(isolate, args[0], args[1], wrapper->encoder.width, wrapper->encoder.height, width, height))
+    return;
+
+  wrapper->encoder.reset(width, height);
+  wrapper->ReportMemory(isolate);
+};
+
 void NodeWrapper::SetRepeat(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
   Isolate *isolate = args.GetIsolate();
@@ -100,6 +215,263 @@ void NodeWrapper::SetQuality(const v8::FunctionCallbackInfo<v8::Value> &args)
   wrapper->encoder.setQuality(quality);
 };
 
+void NodeWrapper::SetHistogramQuantizer(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool enable = args[0]->IsUndefined() ? true : args[0]->BooleanValue(isolate);
+  int threads = args[1]->IsUndefined() ? 1 : args[1]->NumberValue(context).FromMaybe(1);
+
+  wrapper->encoder.setHistogramQuantizer(enable, threads);
+};
+
+void NodeWrapper::SetWarmStart(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool enable = args[0]->IsUndefined() ? true : args[0]->BooleanValue(isolate);
+  int interval = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setWarmStart(enable, interval);
+};
+
+void NodeWrapper::SetGlobalPalette(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int frames = args[0]->IsUndefined() ? 1 : args[0]->NumberValue(context).FromMaybe(0);
+  double maxError = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setGlobalPalette(frames, maxError);
+};
+
+void NodeWrapper::SetLossy(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int level = args[0]->IsUndefined() ? 0 : args[0]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setLossy(level);
+};
+
+void NodeWrapper::SetDeferredClear(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool defer = args[0]->BooleanValue(isolate);
+
+  wrapper->encoder.setDeferredClear(defer);
+};
+
+void NodeWrapper::SetOptimize(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int level = args[0]->IsUndefined() ? 1 : args[0]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setOptimize(level);
+};
+
+void NodeWrapper::SetTimeBudget(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  double frameMs = args[0]->IsUndefined() ? 0 : args[0]->NumberValue(context).FromMaybe(0);
+  double totalMs = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+  int frames = args[2]->IsUndefined() ? 0 : args[2]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setTimeBudget(frameMs, totalMs, frames);
+};
+
+void NodeWrapper::GetFrameStats(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  const FrameStats &stats = wrapper->encoder.stats;
+
+  Local<Object> result = Object::New(isolate);
+  auto set = [&](const char *key, Local<Value> value) {
+    result->Set(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked(), value).FromJust();
+  };
+
+  set("unpackMs", Number::New(isolate, stats.unpackMs));
+  set("overlayMs", Number::New(isolate, stats.overlayMs));
+  set("learnMs", Number::New(isolate, stats.learnMs));
+  set("histogramMs", Number::New(isolate, stats.histogramMs));
+  set("mapMs", Number::New(isolate, stats.mapMs));
+  set("lzwMs", Number::New(isolate, stats.lzwMs));
+  set("writeMs", Number::New(isolate, stats.writeMs));
+  set("totalMs", Number::New(isolate, stats.totalMs));
+  set("budgetMs", Number::New(isolate, stats.budgetMs));
+  set("quality", Number::New(isolate, stats.sample));
+  set("cycles", Number::New(isolate, stats.cycles));
+  set("samples", Number::New(isolate, stats.samples));
+  set("histogram", v8::Boolean::New(isolate, stats.histogram));
+  set("warm", v8::Boolean::New(isolate, stats.warm));
+  set("localPalette", v8::Boolean::New(isolate, stats.localPalette));
+  set("paletteError", Number::New(isolate, stats.paletteError));
+  set("lossy", Number::New(isolate, stats.lossy));
+  set("deferReset", v8::Boolean::New(isolate, stats.deferReset));
+  set("duplicate", v8::Boolean::New(isolate, stats.duplicate));
+  set("cached", v8::Boolean::New(isolate, stats.cached));
+  set("bytes", Number::New(isolate, double(stats.bytes)));
+  set("candidates", Number::New(isolate, stats.candidates));
+
+  // screen area the frame was written to
+  Local<Object> rect = Object::New(isolate);
+  const char *rectKeys[] = {"x", "y", "width", "height"};
+  int rectValues[] = {stats.rect.x, stats.rect.y, stats.rect.width, stats.rect.height};
+  for (int i = 0; i < 4; i++)
+    rect->Set(context, String::NewFromUtf8(isolate, rectKeys[i], NewStringType::kNormal).ToLocalChecked(),
+              Number::New(isolate, rectValues[i])).FromJust();
+  set("rect", rect);
+
+  if (stats.perf)
+  {
+    // counters: {stage: {event: count, poolTasks}}, -1 for events that
+    // aren't available or, with poolTasks, partly ran on pool workers
+    Local<Object> counters = Object::New(isolate);
+    for (int i = 0; i < PERF_STAGES; i++)
+    {
+      Local<Object> stage = Object::New(isolate);
+      for (int j = 0; j < PERF_EVENTS; j++)
+        stage->Set(context, String::NewFromUtf8(isolate, perfEventNames[j], NewStringType::kNormal).ToLocalChecked(),
+                   Number::New(isolate, double(stats.counters[i].value[j]))).FromJust();
+      stage->Set(context, String::NewFromUtf8(isolate, "poolTasks", NewStringType::kNormal).ToLocalChecked(),
+                 Number::New(isolate, double(stats.counters[i].poolTasks))).FromJust();
+      counters->Set(context, String::NewFromUtf8(isolate, perfStageNames[i], NewStringType::kNormal).ToLocalChecked(), stage).FromJust();
+    }
+    set("counters", counters);
+  }
+
+  args.GetReturnValue().Set(result);
+};
+
+void NodeWrapper::SetPerfCounters(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool enable = args[0]->IsUndefined() ? true : args[0]->BooleanValue(isolate);
+
+  args.GetReturnValue().Set(v8::Boolean::New(isolate, wrapper->encoder.setPerfCounters(enable)));
+};
+
+/*
+  setOverlay(rgba, {width, height, x, y, blend}): composites a tightly
+  packed RGBA image onto every following frame. height defaults to what
+  the buffer holds, x and y to 0, blend to "over" ("multiply", "screen").
+  setOverlay(null) removes it.
+*/
+void NodeWrapper::SetOverlay(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  if (args[0]->IsNullOrUndefined())
+  {
+    wrapper->encoder.setOverlay(nullptr, 0, 0, 0, 0, BLEND_OVER);
+    return;
+  }
+
+  size_t length;
+  char *data = FrameData(args[0], length);
+  if (data == nullptr || !args[1]->IsObject())
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "setOverlay expects an RGBA buffer and {width}", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  Local<Object> options = args[1].As<Object>();
+  auto option = [&](const char *key) {
+    return options->Get(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+  };
+  Local<Value> w = option("width");
+  Local<Value> h = option("height");
+  Local<Value> x = option("x");
+  Local<Value> y = option("y");
+  Local<Value> blend = option("blend");
+
+  int width = w->IsUndefined() ? 0 : w->NumberValue(context).FromMaybe(0);
+  int height = h->IsUndefined() && width > 0 ? int(length / (size_t(width) * 4)) : h->NumberValue(context).FromMaybe(0);
+  if (width <= 0 || height <= 0 || length < size_t(width) * height * 4)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Overlay size does not match its buffer", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  BlendMode mode = BLEND_OVER;
+  if (!blend->IsUndefined())
+  {
+    String::Utf8Value name(isolate, blend);
+    if (*name == nullptr || !parseBlendMode(*name, mode))
+    {
+      isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "Unknown blend mode", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+  }
+
+  wrapper->encoder.setOverlay(reinterpret_cast<unsigned char *>(data), width, height,
+                              x->IsUndefined() ? 0 : x->NumberValue(context).FromMaybe(0),
+                              y->IsUndefined() ? 0 : y->NumberValue(context).FromMaybe(0),
+                              mode);
+};
+
+void NodeWrapper::SetDuplicateFrames(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool enable = args[0]->IsUndefined() ? true : args[0]->BooleanValue(isolate);
+  int tolerance = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+
+  wrapper->encoder.setDuplicateFrames(enable, tolerance);
+};
+
+/*
+  setFrameCache(enable): looks frames up in the frame cache shared by all
+  encoders of the process, see GIFEncoder.setFrameCacheSize.
+*/
+void NodeWrapper::SetFrameCache(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  bool enable = args[0]->IsUndefined() ? true : args[0]->BooleanValue(isolate);
+  wrapper->encoder.setFrameCache(enable);
+};
+
 void NodeWrapper::SetFrameRate(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
   Isolate *isolate = args.GetIsolate();
@@ -112,13 +484,689 @@ void NodeWrapper::SetFrameRate(const v8::FunctionCallbackInfo<v8::Value> &args)
   wrapper->encoder.setFrameRate(fps);
 };
 
+/*
+  Reads the {format, stride, delay} options of addFrame and addFrameRows
+  and checks the stride against rows of columns pixels. Throws and
+  returns false on a bad option.
+*/
+static bool FrameOptions(Isolate *isolate, Local<Value> value, int columns, FrameDescriptor &desc, int &delay)
+{
+  Local<Context> context = isolate->GetCurrentContext();
+
+  delay = -1; // -1 = the delay set by setFrameRate
+  if (value->IsObject())
+  {
+    Local<Object> options = value.As<Object>();
+    Local<Value> format = options->Get(context, String::NewFromUtf8(isolate, "format", NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+    Local<Value> stride = options->Get(context, String::NewFromUtf8(isolate, "stride", NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+    Local<Value> frameDelay = options->Get(context, String::NewFromUtf8(isolate, "delay", NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+
+    if (!format->IsUndefined())
+    {
+      String::Utf8Value name(isolate, format);
+      if (*name == nullptr || !parsePixelFormat(*name, desc.format))
+      {
+        isolate->ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "Unknown pixel format", NewStringType::kNormal).ToLocalChecked()));
+        return false;
+      }
+    }
+    if (!stride->IsUndefined())
+      desc.stride = stride->NumberValue(context).FromMaybe(0);
+    if (!frameDelay->IsUndefined())
+      delay = frameDelay->NumberValue(context).FromMaybe(0);
+  }
+
+  size_t rowBytes = size_t(columns) * desc.bytesPerPixel();
+  if (desc.stride != 0 && size_t(desc.stride) < rowBytes)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Stride is smaller than a row", NewStringType::kNormal).ToLocalChecked()));
+    return false;
+  }
+  return true;
+}
+
+/*
+  Reads the {x, y, w, h} options of addFrame and addFrameRegion into
+  rect, which defaults to the rest of the screen from x, y. given is
+  whether any of them was set. Throws and returns false for a rect
+  outside the screen.
+*/
+static bool RegionOptions(Isolate *isolate, Local<Value> value, const GIFEncoder &encoder, FrameRect &rect, bool &given)
+{
+  Local<Context> context = isolate->GetCurrentContext();
+
+  double x = 0, y = 0, w = -1, h = -1;
+  given = false;
+  if (value->IsObject())
+  {
+    Local<Object> options = value.As<Object>();
+    const char *keys[] = {"x", "y", "w", "h"};
+    double *values[] = {&x, &y, &w, &h};
+    for (int i = 0; i < 4; i++)
+    {
+      Local<Value> option = options->Get(context, String::NewFromUtf8(isolate, keys[i], NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+      if (option->IsUndefined())
+        continue;
+      *values[i] = option->NumberValue(context).FromMaybe(0);
+      given = true;
+    }
+  }
+  if (w < 0)
+    w = encoder.width - x;
+  if (h < 0)
+    h = encoder.height - y;
+
+  if (!(x >= 0 && y >= 0 && w >= 1 && h >= 1 && x + w <= encoder.width && y + h <= encoder.height))
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Region is outside the screen", NewStringType::kNormal).ToLocalChecked()));
+    return false;
+  }
+  rect = FrameRect{int(x), int(y), int(w), int(h)};
+  return true;
+}
+
+// Adds frame, or the region rect of the screen when partial is set
+static void AddFrameTo(Isolate *isolate, GIFEncoder &encoder, char *frame, const FrameDescriptor &desc,
+                       const FrameRect &rect, bool partial, int delay)
+{
+  unsigned int frameRateDelay = encoder.delay;
+  if (delay >= 0)
+    encoder.delay = delay;
+  string error;
+  bool added = true;
+  if (partial)
+    added = encoder.addFrameRegion(frame, desc, rect, error);
+  else
+    encoder.addFrame(frame, desc);
+  encoder.delay = frameRateDelay;
+
+  if (!added)
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, error.c_str(), NewStringType::kNormal).ToLocalChecked()));
+  else if (encoder.out.error != 0)
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, strerror(encoder.out.error), NewStringType::kNormal).ToLocalChecked()));
+}
+
+/*
+  addFrame(frame, {format, stride, delay, x, y, w, h}): with any of x, y,
+  w and h only that rect of the whole frame is read and encoded, see
+  addFrameRegion.
+*/
 void NodeWrapper::AddFrame(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  GIFEncoder &encoder = wrapper->encoder;
+
+  if (encoder.rowsPending())
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, "The frame of addFrameRows is incomplete", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  FrameDescriptor desc;
+  int delay;
+  FrameRect rect;
+  bool partial;
+  if (!FrameOptions(isolate, args[1], encoder.width, desc, delay) ||
+      !RegionOptions(isolate, args[1], encoder, rect, partial))
+    return;
+  size_t rowBytes = size_t(encoder.width) * desc.bytesPerPixel();
+
+  size_t length;
+  char *imageData = FrameData(args[0], length);
+  if (imageData == nullptr)
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Frame must be a Buffer, typed array or (Shared)ArrayBuffer", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  size_t needed = encoder.height > 0 ? size_t(desc.rowStride(encoder.width)) * (encoder.height - 1) + rowBytes : 0;
+  if (length < needed)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Frame buffer is too small", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  if (partial)
+  {
+    // rows keep the whole frame's stride, starting at the rect
+    desc.stride = desc.rowStride(encoder.width);
+    imageData += size_t(rect.y) * desc.stride + size_t(rect.x) * desc.bytesPerPixel();
+  }
+  AddFrameTo(isolate, encoder, imageData, desc, rect, partial, delay);
+};
+
+/*
+  addFrameRegion(pixels, {x, y, w, h, format, stride, delay}): a frame
+  that only changes the rect, pixels holding just its w x h pixels. The
+  rect is quantized and compressed on its own and written at x, y over
+  what the screen shows, left in place. w and h default to the rest of
+  the screen.
+*/
+void NodeWrapper::AddFrameRegion(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  GIFEncoder &encoder = wrapper->encoder;
+
+  if (encoder.rowsPending())
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, "The frame of addFrameRows is incomplete", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  FrameRect rect;
+  bool given;
+  if (!RegionOptions(isolate, args[1], encoder, rect, given))
+    return;
+  FrameDescriptor desc;
+  int delay;
+  if (!FrameOptions(isolate, args[1], rect.width, desc, delay))
+    return;
+
+  size_t length;
+  char *pixels = FrameData(args[0], length);
+  if (pixels == nullptr)
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Region must be a Buffer, typed array or (Shared)ArrayBuffer", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  size_t needed = size_t(desc.rowStride(rect.width)) * (rect.height - 1) + size_t(rect.width) * desc.bytesPerPixel();
+  if (length < needed)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Region buffer is too small", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  AddFrameTo(isolate, encoder, pixels, desc, rect, true, delay);
+};
+
+/*
+  addFrameRows(rows, {format, stride, delay}): the next whole rows of a
+  frame, encoded right away. Returns true once they complete the frame.
+  Needs setPalette or a trained global palette.
+*/
+void NodeWrapper::AddFrameRows(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  GIFEncoder &encoder = wrapper->encoder;
+
+  FrameDescriptor desc;
+  int delay;
+  if (!FrameOptions(isolate, args[1], encoder.width, desc, delay))
+    return;
+
+  size_t length;
+  char *rows = FrameData(args[0], length);
+  if (rows == nullptr)
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Rows must be a Buffer, typed array or (Shared)ArrayBuffer", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  // the last row needs no padding up to the stride
+  size_t rowBytes = size_t(encoder.width) * desc.bytesPerPixel();
+  size_t stride = desc.rowStride(encoder.width);
+  size_t count = length >= rowBytes ? (length - rowBytes) / stride + 1 : 0;
+  if (count == 0 || (desc.stride == 0 && length % rowBytes != 0))
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Rows buffer must hold whole rows", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  unsigned int frameRateDelay = encoder.delay;
+  if (delay >= 0)
+    encoder.delay = delay;
+  string error;
+  bool added = encoder.addFrameRows(rows, int(min<size_t>(count, INT_MAX)), desc, error);
+  encoder.delay = frameRateDelay;
+
+  if (!added)
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, error.c_str(), NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+  if (encoder.out.error != 0)
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, strerror(encoder.out.error), NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+  args.GetReturnValue().Set(Boolean::New(isolate, !encoder.rowsPending()));
+};
+
+/*
+  addIndexedFrame(indices, palette, {stride, delay, transparent}): a frame
+  of one palette index per pixel, palette r, g, b bytes of up to 256
+  colors. transparent is the index shown as transparent.
+*/
+void NodeWrapper::AddIndexedFrame(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  GIFEncoder &encoder = wrapper->encoder;
+
+  size_t length, paletteLength;
+  char *indices = FrameData(args[0], length);
+  char *palette = FrameData(args[1], paletteLength);
+  if (indices == nullptr || palette == nullptr)
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Indices and palette must be Buffers, typed arrays or (Shared)ArrayBuffers", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+  if (paletteLength % 3 != 0 || paletteLength == 0 || paletteLength > 256 * 3)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Palette must hold 1 to 256 r, g, b triples", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  int stride = 0;
+  int delay = -1; // -1 = the delay set by setFrameRate
+  int transparentIndex = -1;
+  if (args[2]->IsObject())
+  {
+    Local<Object> options = args[2].As<Object>();
+    auto get = [&](const char *key) {
+      return options->Get(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+    };
+    Local<Value> value = get("stride");
+    if (!value->IsUndefined())
+      stride = value->NumberValue(context).FromMaybe(0);
+    value = get("delay");
+    if (!value->IsUndefined())
+      delay = value->NumberValue(context).FromMaybe(0);
+    value = get("transparent");
+    if (!value->IsNullOrUndefined())
+      transparentIndex = value->NumberValue(context).FromMaybe(-1);
+  }
+  if (stride != 0 && stride < encoder.width)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Stride is smaller than a row", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  size_t rowStride = stride != 0 ? stride : encoder.width;
+  size_t needed = encoder.height > 0 ? rowStride * (encoder.height - 1) + encoder.width : 0;
+  if (length < needed)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Frame buffer is too small", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  unsigned int frameRateDelay = encoder.delay;
+  if (delay >= 0)
+    encoder.delay = delay;
+  string error;
+  bool added = encoder.addIndexedFrame(indices, stride, reinterpret_cast<unsigned char *>(palette),
+                                       int(paletteLength / 3), transparentIndex, error);
+  encoder.delay = frameRateDelay;
+
+  if (!added)
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, error.c_str(), NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+  if (encoder.out.error != 0)
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, strerror(encoder.out.error), NewStringType::kNormal).ToLocalChecked()));
+};
+
+/*
+  estimate(frame | [frames], {format, stride, fraction}): predicts what
+  adding the frames would cost without encoding them, sampling about
+  fraction (0 - 1, default 1/16) of every frame's rows. Returns {bytes, ms,
+  bytesError, msError, sampledRows}, the errors relative bounds; bytes
+  includes the file's header and trailer when the frames would be first.
+  bytesError comes from the sample, msError is a fixed 35% heuristic.
+*/
+void NodeWrapper::Estimate(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+  GIFEncoder &encoder = wrapper->encoder;
+
+  FrameDescriptor desc;
+  int delay;
+  if (!FrameOptions(isolate, args[1], encoder.width, desc, delay))
+    return;
+  double fraction = 1.0 / 16;
+  if (args[1]->IsObject())
+  {
+    Local<Value> value = args[1].As<Object>()->Get(context, String::NewFromUtf8(isolate, "fraction", NewStringType::kNormal).ToLocalChecked()).ToLocalChecked();
+    if (!value->IsUndefined())
+      fraction = value->NumberValue(context).FromMaybe(NAN);
+  }
+  if (!(fraction > 0 && fraction <= 1))
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "fraction must be greater than 0 and at most 1", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  vector<Local<Value>> frames;
+  if (args[0]->IsArray())
+  {
+    Local<v8::Array> list = args[0].As<v8::Array>();
+    for (uint32_t i = 0; i < list->Length(); i++)
+      frames.push_back(list->Get(context, i).ToLocalChecked());
+  }
+  else
+    frames.push_back(args[0]);
+
+  size_t rowBytes = size_t(encoder.width) * desc.bytesPerPixel();
+  size_t needed = encoder.height > 0 ? size_t(desc.rowStride(encoder.width)) * (encoder.height - 1) + rowBytes : 0;
+  double bytes = 0, ms = 0, bytesError = 0, msError = 0;
+  int sampledRows = 0;
+  for (size_t i = 0; i < frames.size(); i++)
+  {
+    size_t length;
+    char *imageData = FrameData(frames[i], length);
+    if (imageData == nullptr || length < needed)
+    {
+      isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "Every frame must be a Buffer, typed array or (Shared)ArrayBuffer of the encoder's size", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+
+    bool first = i == 0 && encoder.firstFrame;
+    FrameEstimate e = encoder.estimate(imageData, desc, fraction, first);
+    bytes += e.bytes + (first ? 1 : 0);
+    ms += e.ms;
+    // the bounds of a sum: errors weighted by their share
+    bytesError += e.bytesError * e.bytes;
+    msError += e.msError * e.ms;
+    sampledRows += e.sampledRows;
+  }
+
+  Local<Object> result = Object::New(isolate);
+  auto set = [&](const char *key, double value) {
+    result->Set(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, value)).FromJust();
+  };
+  set("bytes", round(bytes));
+  set("ms", ms);
+  set("bytesError", bytes > 0 ? bytesError / bytes : 0);
+  set("msError", ms > 0 ? msError / ms : 0);
+  set("sampledRows", sampledRows);
+  args.GetReturnValue().Set(result);
+};
+
+/*
+  setPalette(rgb): r, g, b bytes of up to 256 colors used as the global
+  color table of every frame instead of trained palettes. Call before the
+  first frame; an empty buffer or null goes back to trained palettes.
+*/
+void NodeWrapper::SetPalette(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  size_t length = 0;
+  const unsigned char *rgb = nullptr;
+  if (!args[0]->IsNullOrUndefined())
+  {
+    rgb = reinterpret_cast<unsigned char *>(FrameData(args[0], length));
+    if (rgb == nullptr)
+    {
+      isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "Palette must be a Buffer, typed array or (Shared)ArrayBuffer", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+  }
+  if (length % 3 != 0 || length > 256 * 3)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Palette must hold up to 256 r, g, b triples", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  if (!wrapper->encoder.setPalette(rgb, int(length / 3)))
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, "The palette must be set before the first frame", NewStringType::kNormal).ToLocalChecked()));
+};
+
+/*
+  setOutput(path | fd): streams the GIF to a file instead of returning it
+  from finish, which then returns the number of bytes written.
+*/
+void NodeWrapper::SetOutput(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
   NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
 
-  char *imageData = node::Buffer::Data(args[0]);
+  if (args[0]->IsString())
+  {
+    String::Utf8Value path(isolate, args[0]);
+    if (!wrapper->encoder.setOutput(string(*path)))
+      isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, strerror(wrapper->encoder.out.error), NewStringType::kNormal).ToLocalChecked()));
+  }
+  else if (args[0]->IsNumber())
+  {
+    int fd = args[0]->NumberValue(context).FromMaybe(-1);
+    if (fd < 0)
+    {
+      isolate->ThrowException(Exception::RangeError(
+          String::NewFromUtf8(isolate, "Invalid file descriptor", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+    wrapper->encoder.setOutput(fd);
+  }
+  else
+  {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Output must be a path or a file descriptor", NewStringType::kNormal).ToLocalChecked()));
+  }
+};
+
+/*
+  setPriority(priority): "low", "normal" (the default) or "high", or 0 - 2.
+  Scheduling class of this encoder's work on the shared thread pool.
+*/
+void NodeWrapper::SetPriority(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
 
-  wrapper->encoder.addFrame(imageData);
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int priority = PRIORITY_NORMAL;
+  if (args[0]->IsString())
+  {
+    String::Utf8Value name(isolate, args[0]);
+    string value = *name ? *name : "";
+    if (value == "low")
+      priority = PRIORITY_LOW;
+    else if (value == "high")
+      priority = PRIORITY_HIGH;
+    else if (value != "normal")
+    {
+      isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "Unknown priority", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+  }
+  else if (!args[0]->IsUndefined())
+    priority = args[0]->NumberValue(context).FromMaybe(PRIORITY_NORMAL);
+
+  wrapper->encoder.setPriority(priority);
+};
+
+/*
+  GIFEncoder.setThreadPoolSize(threads): resizes the worker pool shared by
+  all encoders, 0 for one less than the hardware threads. Returns the
+  size in effect, without an argument just that.
+*/
+void NodeWrapper::SetThreadPoolSize(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  ThreadPool &pool = ThreadPool::shared();
+  if (!args[0]->IsUndefined())
+    pool.resize(args[0]->NumberValue(context).FromMaybe(0));
+
+  args.GetReturnValue().Set(Number::New(isolate, pool.size()));
+};
+
+/*
+  GIFEncoder.setFrameCacheSize(bytes): caps the memory of the frame cache,
+  evicting least recently used frames down to it, 0 empties and disables
+  it. The default is 64 MB.
+*/
+void NodeWrapper::SetFrameCacheSize(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  double bytes = args[0]->IsUndefined() ? double(FrameCache::defaultCapacity) : args[0]->NumberValue(context).FromMaybe(0);
+  FrameCache::shared().setCapacity(bytes > 0 ? size_t(bytes) : 0);
+};
+
+/*
+  GIFEncoder.getFrameCacheStats(): {hits, misses, evictions, entries,
+  bytes, capacity} of the frame cache since the process started.
+*/
+void NodeWrapper::GetFrameCacheStats(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  FrameCacheStats stats = FrameCache::shared().statistics();
+
+  Local<Object> result = Object::New(isolate);
+  auto set = [&](const char *key, double value) {
+    result->Set(context, String::NewFromUtf8(isolate, key, NewStringType::kNormal).ToLocalChecked(),
+                Number::New(isolate, value)).FromJust();
+  };
+  set("hits", double(stats.hits));
+  set("misses", double(stats.misses));
+  set("evictions", double(stats.evictions));
+  set("entries", double(stats.entries));
+  set("bytes", double(stats.bytes));
+  set("capacity", double(stats.capacity));
+
+  args.GetReturnValue().Set(result);
+};
+
+/*
+  addOutputSize(width, height): also encodes every frame scaled to that
+  size, returns the index to pass to getOutput after finish. Call before
+  the first frame.
+*/
+void NodeWrapper::AddOutputSize(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int width = args[0]->IsUndefined() ? 0 : args[0]->NumberValue(context).FromMaybe(0);
+  int height = args[1]->IsUndefined() ? 0 : args[1]->NumberValue(context).FromMaybe(0);
+  if (width <= 0 || height <= 0)
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "Output size must be positive", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  if (!wrapper->encoder.addOutputSize(width, height))
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, "Output sizes must be added before the first frame", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+  isolate->AdjustAmountOfExternalAllocatedMemory(int64_t(width) * height * 4);
+  wrapper->reportedBytes += int64_t(width) * height * 4;
+  args.GetReturnValue().Set(Number::New(isolate, double(wrapper->encoder.sizes.size() - 1)));
+};
+
+// getOutput(index): the GIF of an extra output size, after finish
+void NodeWrapper::GetOutput(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  int index = args[0]->IsUndefined() ? -1 : args[0]->NumberValue(context).FromMaybe(-1);
+  if (index < 0 || index >= int(wrapper->encoder.sizes.size()))
+  {
+    isolate->ThrowException(Exception::RangeError(
+        String::NewFromUtf8(isolate, "No output size with that index", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  const vector<unsigned char> &data = wrapper->encoder.sizes[index]->out.data;
+  Local<Object> buf;
+  if (node::Buffer::Copy(isolate, reinterpret_cast<const char *>(data.data()), data.size()).ToLocal(&buf))
+    args.GetReturnValue().Set(buf);
+};
+
+/*
+  append(gif | path): continues an existing GIF instead of start(). A
+  buffer is copied up to its trailer and finish returns the whole GIF, a
+  path is extended in place and finish returns its new size.
+*/
+void NodeWrapper::Append(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  Isolate *isolate = args.GetIsolate();
+
+  NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
+
+  std::string error;
+  bool ok;
+  if (args[0]->IsString())
+  {
+    String::Utf8Value path(isolate, args[0]);
+    ok = wrapper->encoder.appendFile(std::string(*path), error);
+  }
+  else
+  {
+    size_t length;
+    char *data = FrameData(args[0], length);
+    if (data == nullptr)
+    {
+      isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "append expects a GIF buffer or a path", NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+    ok = wrapper->encoder.append(reinterpret_cast<unsigned char *>(data), length, error);
+  }
+
+  if (!ok)
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, error.c_str(), NewStringType::kNormal).ToLocalChecked()));
 };
 
 void NodeWrapper::Finish(const v8::FunctionCallbackInfo<v8::Value> &args)
@@ -126,21 +1174,40 @@ void NodeWrapper::Finish(const v8::FunctionCallbackInfo<v8::Value> &args)
   Isolate *isolate = args.GetIsolate();
   NodeWrapper *wrapper = ObjectWrap::Unwrap<NodeWrapper>(args.Holder());
 
+  if (wrapper->encoder.rowsPending())
+  {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, "The frame of addFrameRows is incomplete", NewStringType::kNormal).ToLocalChecked()));
+    return;
+  }
+
+  bool streaming = wrapper->encoder.out.fd >= 0;
   wrapper->encoder.finish();
 
+  if (streaming)
+  {
+    if (wrapper->encoder.out.error != 0)
+    {
+      isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, strerror(wrapper->encoder.out.error), NewStringType::kNormal).ToLocalChecked()));
+      return;
+    }
+    args.GetReturnValue().Set(Number::New(isolate, double(wrapper->encoder.out.written)));
+    return;
+  }
+
   char *d = reinterpret_cast<char *>(wrapper->encoder.out.data.data());
 
   Local<Object>
       buf;
 
-  node::Buffer::Copy(
-      isolate,
-      d,
-      wrapper->encoder.out.data.size())
-      .ToLocal(&buf);
-
-  args.GetReturnValue()
-      .Set(buf);
+  if (node::Buffer::Copy(
+          isolate,
+          d,
+          wrapper->encoder.out.data.size())
+          .ToLocal(&buf))
+    args.GetReturnValue()
+        .Set(buf);
 }
 
 } // namespace gifencoder
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "overlay.h"
+#include "algorithm"
+#include "cstdint"
+#include "cstring"
+
+using namespace std;
+
+namespace gifencoder
+{
+
+bool parseBlendMode(const char *name, BlendMode &mode)
+{
+  static const struct
+  {
+    const char *name;
+    BlendMode mode;
+  } modes[] = {
+      {"over", BLEND_OVER},
+      {"multiply", BLEND_MULTIPLY},
+      {"screen", BLEND_SCREEN}};
+
+  for (auto &m : modes)
+  {
+    if (strcmp(name, m.name) == 0)
+    {
+      mode = m.mode;
+      return true;
+    }
+  }
+  return false;
+}
+
+// x / 255 rounded, exact for x <= 255 * 255
+static inline unsigned int div255(unsigned int x)
+{
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+void Overlay::set(const unsigned char *rgba, int w, int h, int x, int y, BlendMode blend, int frameWidth, int frameHeight)
+{
+  clear();
+
+  int x0 = max(x, 0), y0 = max(y, 0);
+  int x1 = min(x + w, frameWidth), y1 = min(y + h, frameHeight);
+  if (x1 <= x0 || y1 <= y0)
+    return;
+
+  left = x0;
+  top = y0;
+  width = x1 - x0;
+  height = y1 - y0;
+  mode = blend;
+  mul.resize(size_t(width) * height * 3);
+  add.resize(mul.size());
+  covers.resize(size_t(width) * height);
+
+  for (int i = 0; i < height; i++)
+  {
+    const unsigned char *src = rgba + ((size_t)(top - y + i) * w + (left - x)) * 4;
+    size_t row = size_t(i) * width;
+    for (int j = 0; j < width; j++, src += 4)
+    {
+      unsigned int a = src[3];
+      covers[row + j] = a > 0;
+      for (int c = 0; c < 3; c++)
+      {
+        unsigned int p = div255(src[c] * a); // premultiplied
+        size_t k = (row + j) * 3 + c;
+        switch (mode)
+        {
+        case BLEND_MULTIPLY:
+          mul[k] = 255 - a + p;
+          add[k] = 0;
+          break;
+        case BLEND_SCREEN:
+          mul[k] = 255 - p;
+          add[k] = p;
+          break;
+        default:
+          mul[k] = 255 - a;
+          add[k] = p;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void Overlay::clear()
+{
+  width = height = 0;
+  mul.clear();
+  add.clear();
+  covers.clear();
+}
+
+void Overlay::apply(char *rgb, int frameWidth, vector<char> &alphaMask, int firstRow, int rowCount, int firstColumn) const
+{
+  // overlay rows inside [firstRow, firstRow + rowCount)
+  int from = max(0, firstRow - top);
+  int to = int(min<int64_t>(height, int64_t(firstRow) + rowCount - top));
+  // and columns inside [firstColumn, firstColumn + frameWidth)
+  int first = max(0, firstColumn - left);
+  int last = min(width, firstColumn + frameWidth - left);
+  if (first >= last)
+    return;
+
+  const int n = (last - first) * 3;
+  for (int i = from; i < to; i++)
+  {
+    unsigned char *dst = reinterpret_cast<unsigned char *>(rgb) +
+                         ((size_t)(top + i - firstRow) * frameWidth + left + first - firstColumn) * 3;
+    const unsigned char *m = &mul[(size_t(i) * width + first) * 3];
+    const unsigned char *a = &add[(size_t(i) * width + first) * 3];
+    // 16 bit arithmetic throughout: dst * m + 128 stays below 65536
+    for (int k = 0; k < n; k++)
+    {
+      unsigned short x = (unsigned short)(dst[k] * m[k] + 128);
+      dst[k] = a[k] + (unsigned short)((x + (x >> 8)) >> 8);
+    }
+  }
+
+  if (mode != BLEND_OVER || alphaMask.empty())
+    return;
+  for (int i = from; i < to; i++)
+  {
+    char *mask = &alphaMask[(size_t)(top + i - firstRow) * frameWidth + left + first - firstColumn];
+    const char *c = &covers[size_t(i) * width + first];
+    for (int j = 0; j < last - first; j++)
+      mask[j] &= !c[j];
+  }
+}
+
+} // namespace gifencoder
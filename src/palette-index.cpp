@@ -0,0 +1,93 @@
+#include "palette-index.h"
+#include "algorithm"
+#include "climits"
+
+using namespace std;
+
+namespace gifencoder
+{
+
+// squared distance from v to the interval [lo, hi]
+static int outside(int v, int lo, int hi)
+{
+  int d = v < lo ? lo - v : v > hi ? v - hi : 0;
+  return d * d;
+}
+
+// squared distance from v to the farther end of [lo, hi]
+static int farthest(int v, int lo, int hi)
+{
+  int d = max(v - lo, hi - v);
+  return d * d;
+}
+
+void PaletteIndex::build(const int *palette, int size, const bitset<256> *mask)
+{
+  const int shift = 8 - cellBits;
+  const int span = (1 << shift) - 1;
+
+  vector<Entry> usable;
+  for (int i = 0; i < size; i++)
+  {
+    if (mask == nullptr || mask->test(i))
+      usable.push_back(Entry{palette[i * 3], palette[i * 3 + 1], palette[i * 3 + 2], i});
+  }
+
+  clear();
+  if (usable.empty())
+    return;
+
+  for (int cell = 0; cell < cells; cell++)
+  {
+    int rlo = (cell >> (cellBits * 2)) << shift;
+    int glo = ((cell >> cellBits) & ((1 << cellBits) - 1)) << shift;
+    int blo = (cell & ((1 << cellBits) - 1)) << shift;
+
+    int bound = INT_MAX;
+    for (const Entry &e : usable)
+    {
+      int d = farthest(e.r, rlo, rlo + span) + farthest(e.g, glo, glo + span) + farthest(e.b, blo, blo + span);
+      bound = min(bound, d);
+    }
+
+    cellStart[cell] = entries.size();
+    for (const Entry &e : usable)
+    {
+      int d = outside(e.r, rlo, rlo + span) + outside(e.g, glo, glo + span) + outside(e.b, blo, blo + span);
+      if (d <= bound)
+        entries.push_back(e);
+    }
+  }
+  cellStart[cells] = entries.size();
+}
+
+void PaletteIndex::clear()
+{
+  entries.clear();
+  fill(cellStart, cellStart + cells + 1, 0);
+}
+
+int PaletteIndex::lookup(int r, int g, int b) const
+{
+  const int shift = 8 - cellBits;
+  int cell = ((r >> shift) << (cellBits * 2)) | ((g >> shift) << cellBits) | (b >> shift);
+
+  int best = -1;
+  int bestd = INT_MAX;
+  for (int i = cellStart[cell]; i < cellStart[cell + 1]; i++)
+  {
+    const Entry &e = entries[i];
+    int dr = r - e.r;
+    int dg = g - e.g;
+    int db = b - e.b;
+    int d = dr * dr + dg * dg + db * db;
+    if (d < bestd)
+    {
+      bestd = d;
+      best = e.index;
+    }
+  }
+  return best;
+}
+
+} // namespace gifencoder
@@ -0,0 +1,122 @@
+#include "perf-counters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "cstring"
+#endif
+
+namespace gifencoder
+{
+
+const char *const perfStageNames[PERF_STAGES] = {"unpack", "learn", "inxbuild", "map", "lzw", "write"};
+const char *const perfEventNames[PERF_EVENTS] = {"cycles", "instructions", "llcMisses", "branchMisses", "taskClockNs"};
+
+PerfCounters::PerfCounters()
+{
+  for (int i = 0; i < PERF_EVENTS; i++)
+    fds[i] = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+  close();
+}
+
+#ifdef __linux__
+
+bool PerfCounters::open()
+{
+  static const struct
+  {
+    unsigned int type;
+    unsigned long long config;
+  } events[PERF_EVENTS] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, // last level cache
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}};
+
+  close();
+  for (int i = 0; i < PERF_EVENTS; i++)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.exclude_kernel = 1; // allowed with perf_event_paranoid 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    isOpen = isOpen || fds[i] >= 0;
+  }
+  return isOpen;
+}
+
+void PerfCounters::close()
+{
+  for (int i = 0; i < PERF_EVENTS; i++)
+  {
+    if (fds[i] >= 0)
+      ::close(fds[i]);
+    fds[i] = -1;
+  }
+  isOpen = false;
+}
+
+PerfSample PerfCounters::read() const
+{
+  PerfSample sample;
+  for (int i = 0; i < PERF_EVENTS; i++)
+  {
+    uint64_t data[3]; // value, time enabled, time running
+    if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data))
+    {
+      sample.value[i] = -1;
+      continue;
+    }
+    // extrapolate when the counter only ran part of the time
+    double scale = data[2] > 0 && data[2] < data[1] ? double(data[1]) / data[2] : 1;
+    sample.value[i] = int64_t(data[0] * scale);
+  }
+  return sample;
+}
+
+#else
+
+bool PerfCounters::open()
+{
+  return false;
+}
+
+void PerfCounters::close()
+{
+}
+
+PerfSample PerfCounters::read() const
+{
+  PerfSample sample;
+  for (int i = 0; i < PERF_EVENTS; i++)
+    sample.value[i] = -1;
+  return sample;
+}
+
+#endif
+
+void PerfCounters::addSince(const PerfSample &start, PerfSample &total) const
+{
+  PerfSample now = read();
+  for (int i = 0; i < PERF_EVENTS; i++)
+  {
+    if (now.value[i] < 0 || start.value[i] < 0)
+      total.value[i] = -1;
+    else if (total.value[i] >= 0)
+      total.value[i] += now.value[i] - start.value[i];
+  }
+}
+
+} // namespace gifencoder
@@ -0,0 +1,159 @@
+#include "pixel-format.h"
+#include "algorithm"
+#include "cstring"
+#include "vector"
+
+namespace gifencoder
+{
+
+int FrameDescriptor::bytesPerPixel() const
+{
+  switch (format)
+  {
+  case PIXEL_RGB:
+    return 3;
+  case PIXEL_GRAY:
+    return 1;
+  default:
+    return 4;
+  }
+}
+
+int FrameDescriptor::alphaOffset() const
+{
+  switch (format)
+  {
+  case PIXEL_RGBA:
+  case PIXEL_BGRA:
+    return 3;
+  case PIXEL_ARGB:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+int FrameDescriptor::rowStride(int width) const
+{
+  return stride > 0 ? stride : width * bytesPerPixel();
+}
+
+bool parsePixelFormat(const char *name, PixelFormat &format)
+{
+  static const struct
+  {
+    const char *name;
+    PixelFormat format;
+  } formats[] = {
+      {"rgba", PIXEL_RGBA},
+      {"rgb", PIXEL_RGB},
+      {"bgra", PIXEL_BGRA},
+      {"argb", PIXEL_ARGB},
+      {"gray", PIXEL_GRAY},
+      {"grey", PIXEL_GRAY}};
+
+  for (auto &f : formats)
+  {
+    if (strcmp(name, f.name) == 0)
+    {
+      format = f.format;
+      return true;
+    }
+  }
+  return false;
+}
+
+void unpackPixels(const char *src, const FrameDescriptor &desc, int width, int height, char *dst)
+{
+  int stride = desc.rowStride(width);
+
+  switch (desc.format)
+  {
+  case PIXEL_RGBA:
+    unpackPixels<4, 0, 1, 2>(src, stride, width, height, dst);
+    break;
+  case PIXEL_RGB:
+    unpackPixels<3, 0, 1, 2>(src, stride, width, height, dst);
+    break;
+  case PIXEL_BGRA:
+    unpackPixels<4, 2, 1, 0>(src, stride, width, height, dst);
+    break;
+  case PIXEL_ARGB:
+    unpackPixels<4, 1, 2, 3>(src, stride, width, height, dst);
+    break;
+  case PIXEL_GRAY:
+    unpackPixels<1, 0, 0, 0>(src, stride, width, height, dst);
+    break;
+  }
+}
+
+// Source pixels covered by one output pixel and the share of each
+struct AreaTaps
+{
+  std::vector<int> first, count;
+  std::vector<float> weight;
+
+  // output pixel i covers [i * src, (i + 1) * src) in units of 1 / dst source pixels
+  AreaTaps(int src, int dst) : first(dst), count(dst)
+  {
+    for (int i = 0; i < dst; i++)
+    {
+      long lo = (long)i * src, hi = (long)(i + 1) * src;
+      first[i] = lo / dst;
+      int last = (hi + dst - 1) / dst;
+      count[i] = last - first[i];
+      for (int s = first[i]; s < last; s++)
+      {
+        long overlap = std::min(hi, (long)(s + 1) * dst) - std::max(lo, (long)s * dst);
+        weight.push_back(float(overlap) / src);
+      }
+    }
+  }
+};
+
+void scalePixels(const char *src, int srcWidth, int srcHeight, char *dst, int dstWidth, int dstHeight)
+{
+  AreaTaps columns(srcWidth, dstWidth);
+  AreaTaps rows(srcHeight, dstHeight);
+
+  const int n = dstWidth * 3;
+  std::vector<float> row(n), sum(n);
+  const float *rowWeight = rows.weight.data();
+  for (int y = 0; y < dstHeight; y++)
+  {
+    std::fill(sum.begin(), sum.end(), 0.0f);
+    for (int t = 0; t < rows.count[y]; t++)
+    {
+      // horizontal pass over one source row
+      const unsigned char *in = reinterpret_cast<const unsigned char *>(src) + (long)(rows.first[y] + t) * srcWidth * 3;
+      const float *w = columns.weight.data();
+      for (int x = 0; x < dstWidth; x++)
+      {
+        float r = 0, g = 0, b = 0;
+        const unsigned char *p = in + columns.first[x] * 3;
+        for (int k = 0; k < columns.count[x]; k++, p += 3)
+        {
+          r += w[k] * p[0];
+          g += w[k] * p[1];
+          b += w[k] * p[2];
+        }
+        w += columns.count[x];
+        row[x * 3] = r;
+        row[x * 3 + 1] = g;
+        row[x * 3 + 2] = b;
+      }
+
+      // vertical pass, weighted sum of whole rows
+      float wy = rowWeight[t];
+      for (int k = 0; k < n; k++)
+        sum[k] += wy * row[k];
+    }
+    rowWeight += rows.count[y];
+
+    unsigned char *out = reinterpret_cast<unsigned char *>(dst) + (long)y * n;
+    for (int k = 0; k < n; k++)
+      out[k] = (unsigned char)std::min(255.0f, sum[k] + 0.5f);
+  }
+}
+
+} // namespace gifencoder
@@ -0,0 +1,309 @@
+#include "thread-pool.h"
+#include "algorithm"
+
+namespace gifencoder
+{
+
+// the worker running on this thread, if any
+static thread_local void *currentWorker = nullptr;
+// tasks submitted by this thread, see submittedByThread
+static thread_local int64_t threadSubmitted = 0;
+
+ThreadPool &ThreadPool::shared()
+{
+  // never destroyed, workers may still be asleep in it at exit
+  static ThreadPool *pool = [] {
+    ThreadPool *p = new ThreadPool();
+    p->resize(0);
+    return p;
+  }();
+  return *pool;
+}
+
+void ThreadPool::resize(int n)
+{
+  std::lock_guard<std::mutex> guard(resizeLock);
+  if (n < 1)
+    n = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+  n = std::min(n, maxWorkers);
+
+  // idle workers have empty deques, so stopping loses nothing
+  {
+    std::lock_guard<std::mutex> sleep(sleepLock);
+    for (int i = n; i < threads; i++)
+      workers[i].stop = true;
+  }
+  workReady.notify_all();
+  for (int i = n; i < threads; i++)
+    workers[i].thread.join();
+
+  for (int i = threads; i < n; i++)
+  {
+    workers[i].stop = false;
+    workers[i].thread = std::thread(&ThreadPool::workerLoop, this, &workers[i]);
+  }
+  threads = n;
+  if (slots < n)
+    slots = n;
+}
+
+int64_t ThreadPool::submittedByThread()
+{
+  return threadSubmitted;
+}
+
+void ThreadPool::submit(TaskGroup *group, Function function)
+{
+  threadSubmitted++;
+  group->pending++;
+  Task task;
+  task.function = std::move(function);
+  task.group = group;
+
+  Worker *worker = static_cast<Worker *>(currentWorker);
+  if (worker != nullptr)
+  {
+    {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      worker->tasks.push_back(std::move(task));
+    }
+    localQueued++;
+    queued++;
+    notifyWorkers();
+    notifyWaiters(); // they may steal it
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(injectLock);
+    group->queue.push_back(std::move(task));
+    if (!group->scheduled)
+    {
+      ready[group->level].push_back(group);
+      group->scheduled = true;
+    }
+  }
+  queued++;
+  notifyWorkers();
+}
+
+void ThreadPool::run(Task &task)
+{
+  TaskGroup *group = task.group;
+  try
+  {
+    task.function();
+  }
+  catch (...)
+  {
+    // rethrown by the group's wait(), a worker must not unwind past here
+    std::lock_guard<std::mutex> guard(group->errorLock);
+    if (!group->error)
+      group->error = std::current_exception();
+  }
+  // the group may be gone as soon as pending reaches 0
+  if (--group->pending == 0)
+    notifyWaiters();
+}
+
+bool ThreadPool::popLocal(Worker *worker, Task &task)
+{
+  std::lock_guard<std::mutex> guard(worker->lock);
+  if (worker->tasks.empty())
+    return false;
+  task = std::move(worker->tasks.back());
+  worker->tasks.pop_back();
+  localQueued--;
+  queued--;
+  return true;
+}
+
+bool ThreadPool::popInjected(Task &task)
+{
+  std::lock_guard<std::mutex> guard(injectLock);
+  for (int level = PRIORITIES - 1; level >= 0; level--)
+  {
+    std::deque<TaskGroup *> &groups = ready[level];
+    while (!groups.empty())
+    {
+      TaskGroup *group = groups.front();
+      groups.pop_front();
+      if (group->queue.empty())
+      {
+        // drained by its own wait()
+        group->scheduled = false;
+        continue;
+      }
+
+      task = std::move(group->queue.front());
+      group->queue.pop_front();
+      // back of the line, the next task goes to another group
+      if (group->queue.empty())
+        group->scheduled = false;
+      else
+        groups.push_back(group);
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::popGroup(TaskGroup *group, Task &task)
+{
+  std::lock_guard<std::mutex> guard(injectLock);
+  if (group->queue.empty())
+    return false;
+  task = std::move(group->queue.front());
+  group->queue.pop_front();
+  queued--;
+  return true;
+}
+
+bool ThreadPool::steal(Task &task)
+{
+  if (localQueued <= 0)
+    return false;
+
+  // start at a different victim each time to spread contention
+  static thread_local unsigned int next = 0;
+  int count = slots;
+  for (int i = 0; i < count; i++)
+  {
+    Worker &victim = workers[(next + i) % count];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (victim.tasks.empty())
+      continue;
+    task = std::move(victim.tasks.front());
+    victim.tasks.pop_front();
+    localQueued--;
+    queued--;
+    next += i + 1;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::workerLoop(Worker *worker)
+{
+  currentWorker = worker;
+  while (true)
+  {
+    Task task;
+    if (popLocal(worker, task) || popInjected(task) || steal(task))
+    {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> sleep(sleepLock);
+    workReady.wait(sleep, [&] { return worker->stop || queued > 0; });
+    if (worker->stop)
+      break;
+  }
+  currentWorker = nullptr;
+}
+
+void ThreadPool::notifyWorkers()
+{
+  // taking the lock orders this after a sleeper's check of queued
+  {
+    std::lock_guard<std::mutex> sleep(sleepLock);
+  }
+  workReady.notify_one();
+}
+
+void ThreadPool::notifyWaiters()
+{
+  {
+    std::lock_guard<std::mutex> sleep(sleepLock);
+  }
+  taskDone.notify_all();
+}
+
+TaskGroup::~TaskGroup()
+{
+  drain();
+  if (!submitted)
+    return;
+
+  ThreadPool &pool = ThreadPool::shared();
+  std::lock_guard<std::mutex> guard(pool.injectLock);
+  if (!scheduled)
+    return;
+  for (auto &groups : pool.ready)
+    groups.erase(std::remove(groups.begin(), groups.end(), this), groups.end());
+}
+
+void TaskGroup::setPriority(int p)
+{
+  level = std::min(std::max(p, int(PRIORITY_LOW)), int(PRIORITY_HIGH));
+}
+
+void TaskGroup::run(std::function<void()> function)
+{
+  submitted = true;
+  ThreadPool::shared().submit(this, std::move(function));
+}
+
+void TaskGroup::wait()
+{
+  drain();
+  std::exception_ptr thrown;
+  {
+    std::lock_guard<std::mutex> guard(errorLock);
+    std::swap(thrown, error);
+  }
+  if (thrown)
+    std::rethrow_exception(thrown);
+}
+
+void TaskGroup::drain()
+{
+  if (pending == 0)
+    return;
+
+  ThreadPool &pool = ThreadPool::shared();
+  ThreadPool::Worker *worker = static_cast<ThreadPool::Worker *>(currentWorker);
+  while (pending > 0)
+  {
+    ThreadPool::Task task;
+    if ((worker != nullptr && pool.popLocal(worker, task)) || pool.popGroup(this, task) || pool.steal(task))
+    {
+      pool.run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> sleep(pool.sleepLock);
+    pool.taskDone.wait(sleep, [&] { return pending == 0 || pool.localQueued > 0; });
+  }
+}
+
+void TaskGroup::parallel(int count, const std::function<void(int)> &function)
+{
+  if (count <= 1)
+  {
+    if (count == 1)
+      function(0);
+    return;
+  }
+
+  for (int i = 1; i < count; i++)
+    run([&function, i] { function(i); });
+  try
+  {
+    function(0);
+  }
+  catch (...)
+  {
+    drain(); // the tasks still reference function
+    {
+      std::lock_guard<std::mutex> guard(errorLock);
+      error = nullptr; // this exception wins over theirs
+    }
+    throw;
+  }
+  wait();
+}
+
+} // namespace gifencoder
@@ -1,11 +1,14 @@
 #include "typed-neu-quant.h"
 #include "iostream"
+#include "chrono"
 #include "cstdlib"
 #include "cmath"
 #include <array>
 #include "boost/compute/container/vector.hpp"
 #include "valarray"
 #include "numeric"
+#include "algorithm"
+#include "vector"
 
 using namespace std;
 
@@ -26,8 +29,8 @@ namespace gifencoder
 */
 TypedNeuQuant::TypedNeuQuant(char*& p, int s, int pixLen) : 
 pixels(p), 
-samplefac(s), 
 pixLen(pixLen),
+samplefac(s), 
 network_0(netsize),
 network_1(netsize),
 network_2(netsize),
@@ -188,34 +191,31 @@ int TypedNeuQuant::contest(int b, int g, int r)
   */
 void TypedNeuQuant::inxbuild()
 {
-  int smallpos;
-  double smallval, previouscol = 0, startpos = 0;
+  // order the neurons by g once instead of a selection sort per position
+  vector<int> order(netsize);
   for (int i = 0; i < netsize; i++)
-  {
-    smallpos = i;
-    smallval = network_1[i]; // index on g
-    // find smallest in i..netsize-1
-    for (int j = i + 1; j < netsize; j++)
-    {
-      if (network_1[j] < smallval)
-      { // index on g
-        smallpos = j;
-        smallval = network_1[j]; // index on g
-      }
-    }
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [this](int p, int q) {
+    return network_1[p] < network_1[q]; // index on g
+  });
 
-    // swap p (i) and q (smallpos) entries
-    if (i != smallpos)
-    {
-      double j;
-
-      j = network_0[smallpos]; network_0[smallpos] = network_0[i]; network_0[i] = j;
-      j = network_1[smallpos]; network_1[smallpos] = network_1[i]; network_1[i] = j;
-      j = network_2[smallpos]; network_2[smallpos] = network_2[i]; network_2[i] = j;
-      j = network_3[smallpos]; network_3[smallpos] = network_3[i]; network_3[i] = j;
-    }
-    // smallval entry is now in position i
+  valarray<double> n0(netsize), n1(netsize), n2(netsize), n3(netsize);
+  for (int i = 0; i < netsize; i++)
+  {
+    n0[i] = network_0[order[i]];
+    n1[i] = network_1[order[i]];
+    n2[i] = network_2[order[i]];
+    n3[i] = network_3[order[i]];
+  }
+  network_0 = n0;
+  network_1 = n1;
+  network_2 = n2;
+  network_3 = n3;
 
+  double smallval, previouscol = 0, startpos = 0;
+  for (int i = 0; i < netsize; i++)
+  {
+    smallval = network_1[i];
     if (smallval != previouscol)
     {
       netindex[int(previouscol)] = int(startpos + i) >> 1;
@@ -254,24 +254,24 @@ int TypedNeuQuant::inxsearch(int b, int g, int r)
         i = netsize; // stop iter
       else
       {
-        i++;
+        int p = i++;
         if (dist < 0)
           dist = -dist;
 
-        a = network_0[i] - b;
+        a = network_0[p] - b;
         if (a < 0)
           a = -a;
         dist += a;
         if (dist < bestd)
         {
-          a = network_2[i] - r;
+          a = network_2[p] - r;
           if (a < 0)
             a = -a;
           dist += a;
           if (dist < bestd)
           {
             bestd = dist;
-            best = network_3[i];
+            best = network_3[p];
           }
         }
       }
@@ -283,23 +283,23 @@ int TypedNeuQuant::inxsearch(int b, int g, int r)
         j = -1; // stop iter
       else
       {
-        j--;
+        int p = j--;
         if (dist < 0)
           dist = -dist;
-        a = network_0[j] - b;
+        a = network_0[p] - b;
         if (a < 0)
           a = -a;
         dist += a;
         if (dist < bestd)
         {
-          a = network_2[j] - r;
+          a = network_2[p] - r;
           if (a < 0)
             a = -a;
           dist += a;
           if (dist < bestd)
           {
             bestd = dist;
-            best = network_3[j];
+            best = network_3[p];
           }
         }
       }
@@ -309,6 +309,71 @@ int TypedNeuQuant::inxsearch(int b, int g, int r)
   return best;
 };
 
+/*
+    Private Method: buildHistogram
+
+    bins the frame into 5-6-5 buckets, optionally splitting the pixels
+    into parts run on the shared thread pool, then keeps the mean colour and cumulative weight of
+    every occupied bucket
+  */
+void TypedNeuQuant::buildHistogram()
+{
+  struct Bin
+  {
+    uint64_t count, b, g, r;
+  };
+
+  int npix = pixLen / 3;
+  int nthreads = max(1, min(threads, npix / 65536 + 1));
+  vector<vector<Bin>> bins(nthreads, vector<Bin>(histogramBins, Bin{0, 0, 0, 0}));
+
+  auto fill = [&](int t) {
+    vector<Bin> &hist = bins[t];
+    int from = int(int64_t(npix) * t / nthreads);
+    int to = int(int64_t(npix) * (t + 1) / nthreads);
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(pixels) + from * 3;
+    for (int k = from; k < to; k++, p += 3)
+    {
+      Bin &bin = hist[((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3)];
+      bin.count++;
+      bin.b += p[0];
+      bin.g += p[1];
+      bin.r += p[2];
+    }
+  };
+
+  if (tasks != nullptr)
+    tasks->parallel(nthreads, fill);
+  else
+  {
+    for (int t = 0; t < nthreads; t++)
+      fill(t);
+  }
+
+  histColors.clear();
+  histWeights.clear();
+  uint64_t total = 0;
+  for (int k = 0; k < histogramBins; k++)
+  {
+    Bin bin = bins[0][k];
+    for (int t = 1; t < nthreads; t++)
+    {
+      bin.count += bins[t][k].count;
+      bin.b += bins[t][k].b;
+      bin.g += bins[t][k].g;
+      bin.r += bins[t][k].r;
+    }
+    if (bin.count == 0)
+      continue;
+
+    histColors.push_back(int((bin.b << netbiasshift) / bin.count));
+    histColors.push_back(int((bin.g << netbiasshift) / bin.count));
+    histColors.push_back(int((bin.r << netbiasshift) / bin.count));
+    total += bin.count;
+    histWeights.push_back(total);
+  }
+};
+
 /*
     Private Method: learn
 
@@ -321,9 +386,28 @@ void TypedNeuQuant::learn()
   int lengthcount = pixLen;
   int alphadec = 30 + ((samplefac - 1) / 3);
   int samplepixels = lengthcount / (3 * samplefac);
-  int delta = ~~(samplepixels / ncycles);
+  if (useHistogram)
+  {
+    auto t1 = chrono::high_resolution_clock::now();
+    buildHistogram();
+    auto t2 = chrono::high_resolution_clock::now();
+    histogramMs = chrono::duration<double, milli>(t2 - t1).count();
+    samplepixels = min(samplepixels, int(histWeights.size()) * histogramSamples);
+  }
+  int cycles = ncycles;
   double alpha = initalpha;
   double radius = initradius;
+  if (warmNetwork != nullptr)
+  {
+    // the network is already close, refine it with a short tail of the
+    // usual schedule
+    cycles = min(ncycles, warmCycles);
+    samplepixels = samplepixels * cycles / ncycles;
+    alpha = initalpha >> warmShift;
+    radius = initradius >> warmShift;
+  }
+  samples = samplepixels;
+  int delta = ~~(samplepixels / cycles);
 
   double rad = int(radius) >> radiusbiasshift;
 
@@ -365,12 +449,33 @@ void TypedNeuQuant::learn()
   int b, g, r, j;
   int pix = 0; // current pixel
 
+  // golden ratio sequence over the histogram weights, spreads consecutive
+  // samples across the colour distribution like the prime step does over
+  // the image
+  const double golden = 0.6180339887498949;
+  double u = 0;
+  double totalWeight = useHistogram && !histWeights.empty() ? double(histWeights.back()) : 0;
+
   i = 0;
   while (i < samplepixels)
   {
-    b = int(pixels[pix] & 0xff) << netbiasshift;
-    g = int(pixels[pix + 1] & 0xff) << netbiasshift;
-    r = int(pixels[pix + 2] & 0xff) << netbiasshift;
+    if (useHistogram)
+    {
+      u += golden;
+      if (u >= 1)
+        u -= 1;
+      uint64_t target = uint64_t(u * totalWeight);
+      int bin = upper_bound(histWeights.begin(), histWeights.end(), target) - histWeights.begin();
+      b = histColors[bin * 3];
+      g = histColors[bin * 3 + 1];
+      r = histColors[bin * 3 + 2];
+    }
+    else
+    {
+      b = int(pixels[pix] & 0xff) << netbiasshift;
+      g = int(pixels[pix + 1] & 0xff) << netbiasshift;
+      r = int(pixels[pix + 2] & 0xff) << netbiasshift;
+    }
 
     j = contest(b, g, r);
 
@@ -402,32 +507,33 @@ void TypedNeuQuant::learn()
 /*
     Method: buildColormap
 
-    1. initializes network
+    1. initializes network, or starts from warmNetwork
     2. trains it
     3. removes misconceptions
     4. builds colorindex
   */
 void TypedNeuQuant::buildColormap()
 {
-  auto t1 = chrono::high_resolution_clock::now();
   init();
-  auto t2 = chrono::high_resolution_clock::now();
-  cout << "init: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
-
-  t1 = chrono::high_resolution_clock::now();
+  if (warmNetwork != nullptr)
+  {
+    network_0 = warmNetwork[0];
+    network_1 = warmNetwork[1];
+    network_2 = warmNetwork[2];
+  }
   learn();
-  t2 = chrono::high_resolution_clock::now();
-  cout << "learn: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
-
-  t1 = chrono::high_resolution_clock::now();
+  learned[0] = network_0;
+  learned[1] = network_1;
+  learned[2] = network_2;
   unbiasnet();
-  t2 = chrono::high_resolution_clock::now();
-  cout << "unbiasnet: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
-
-  t1 = chrono::high_resolution_clock::now();
-  inxbuild();
-  t2 = chrono::high_resolution_clock::now();
-  cout << "inxbuild: " << chrono::duration_cast<chrono::microseconds>(t2 - t1).count() << endl;
+  if (perf != nullptr && perf->enabled())
+  {
+    PerfSample start = perf->read();
+    inxbuild();
+    perf->addSince(start, inxbuildCounters);
+  }
+  else
+    inxbuild();
 };
 /*
     Method: getColormap
@@ -0,0 +1,259 @@
+// Encode/decode round trips through the native encoder and decoder.
+//
+//   node test/roundtrip.js [--addon <path>]   (npm test)
+//
+// Every case encodes a few frames, decodes the GIF with GIFEncoder.Decoder
+// and checks the canvas against the input: pixel for pixel for lossless
+// encodes, within the tolerated colour error for lossy ones.
+const assert = require("assert");
+const fs = require("fs");
+const path = require("path");
+
+const args = process.argv.slice(2);
+const addonArg = args.indexOf("--addon");
+const GIFEncoder = require(findAddon(addonArg >= 0 ? args[addonArg + 1] : null));
+
+const width = 64;
+const height = 48;
+
+// 64 colours, distinct enough that nearest colour mapping is exact
+const palette = Buffer.alloc(64 * 3);
+for (let i = 0; i < 64; i++) {
+  palette[i * 3] = (i & 3) * 85;
+  palette[i * 3 + 1] = ((i >> 2) & 3) * 85;
+  palette[i * 3 + 2] = ((i >> 4) & 3) * 85;
+}
+
+// 64 greys 4 apart, close enough for lossy matching to substitute them
+const ramp = Buffer.alloc(64 * 3);
+for (let i = 0; i < 64 * 3; i++) ramp[i] = Math.floor(i / 3) * 4;
+
+const cases = [];
+function test(name, fn) {
+  cases.push({ name, fn });
+}
+
+// Palette indices of frame f: diagonal bands that move with f
+function frameIndices(f) {
+  const indices = Buffer.alloc(width * height);
+  for (let y = 0; y < height; y++) {
+    for (let x = 0; x < width; x++) {
+      indices[y * width + x] = ((x >> 2) + (y >> 3) * 5 + f * 3) & 63;
+    }
+  }
+  return indices;
+}
+
+// Ramp indices of frame f: a noisy gradient
+function rampIndices(f) {
+  const indices = Buffer.alloc(width * height);
+  let seed = f + 1;
+  for (let i = 0; i < indices.length; i++) {
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    indices[i] = Math.min(63, ((i % width) >> 1) + (seed % 5));
+  }
+  return indices;
+}
+
+// RGBA pixels of palette indices
+function toRgba(indices, colors = palette) {
+  const rgba = Buffer.alloc(indices.length * 4);
+  for (let i = 0; i < indices.length; i++) {
+    colors.copy(rgba, i * 4, indices[i] * 3, indices[i] * 3 + 3);
+    rgba[i * 4 + 3] = 255;
+  }
+  return rgba;
+}
+
+// The decoded canvas after every frame, as RGBA copies
+function decode(gif) {
+  const decoder = new GIFEncoder.Decoder(gif);
+  assert.strictEqual(decoder.width, width);
+  assert.strictEqual(decoder.height, height);
+  const canvases = [];
+  while (decoder.next() !== null) canvases.push(Buffer.from(decoder.canvas));
+  return canvases;
+}
+
+function newEncoder(colors = palette) {
+  const encoder = new GIFEncoder(width, height);
+  encoder.start();
+  encoder.setRepeat(0);
+  encoder.setPalette(colors);
+  return encoder;
+}
+
+function assertPixels(actual, expected, what) {
+  if (actual.equals(expected)) return;
+  for (let i = 0; i < expected.length; i += 4) {
+    if (actual.readUInt32BE(i) !== expected.readUInt32BE(i)) {
+      const at = `(${(i / 4) % width}, ${Math.floor(i / 4 / width)})`;
+      assert.fail(`${what}: pixel ${at} is ${actual.slice(i, i + 4).toString("hex")}, expected ${expected.slice(i, i + 4).toString("hex")}`);
+    }
+  }
+}
+
+test("lossless frames decode to their pixels", () => {
+  const encoder = newEncoder();
+  const frames = [0, 1, 2].map((f) => toRgba(frameIndices(f)));
+  for (const frame of frames) encoder.addFrame(frame);
+  const canvases = decode(encoder.finish());
+  assert.strictEqual(canvases.length, frames.length);
+  canvases.forEach((canvas, f) => assertPixels(canvas, frames[f], `frame ${f}`));
+});
+
+test("lossy frames stay within the tolerated colour error", () => {
+  const level = 80;
+  const frames = [0, 1, 2].map((f) => toRgba(rampIndices(f), ramp));
+  const encode = (lossy) => {
+    const encoder = newEncoder(ramp);
+    encoder.setLossy(lossy);
+    for (const frame of frames) encoder.addFrame(frame);
+    return encoder.finish();
+  };
+  const gif = encode(level);
+  assert.ok(gif.length < encode(0).length, "lossy GIF is not smaller");
+  const canvases = decode(gif);
+  // the weighted distance lzw-encoder.cpp allows for a substitute
+  const maxError = level >> 2;
+  const threshold = 9 * maxError * maxError;
+  canvases.forEach((canvas, f) => {
+    for (let i = 0; i < canvas.length; i += 4) {
+      const dr = canvas[i] - frames[f][i];
+      const dg = canvas[i + 1] - frames[f][i + 1];
+      const db = canvas[i + 2] - frames[f][i + 2];
+      assert.ok(2 * dr * dr + 4 * dg * dg + 3 * db * db <= threshold, `frame ${f} pixel ${i / 4} off by ${dr}, ${dg}, ${db}`);
+      assert.strictEqual(canvas[i + 3], 255);
+    }
+  });
+});
+
+test("indexed frames decode to their palette colours", () => {
+  const encoder = new GIFEncoder(width, height);
+  encoder.start();
+  const indices = frameIndices(4);
+  encoder.addIndexedFrame(indices, palette);
+  const canvases = decode(encoder.finish());
+  assertPixels(canvases[0], toRgba(indices), "indexed frame");
+});
+
+test("transparent indices stay transparent, lossy or not", () => {
+  for (const level of [0, 80]) {
+    const encoder = new GIFEncoder(width, height);
+    encoder.start();
+    encoder.setLossy(level);
+    // a hole in a gradient whose neighbouring greys lossy matching could
+    // otherwise use for it, or it for them
+    const indices = rampIndices(5);
+    const transparent = 20;
+    for (let y = 16; y < 32; y++) indices.fill(transparent, y * width + 16, y * width + 48);
+    encoder.addIndexedFrame(indices, ramp, { transparent });
+    const canvas = decode(encoder.finish())[0];
+    for (let i = 0; i < indices.length; i++) {
+      assert.strictEqual(canvas[i * 4 + 3] === 0, indices[i] === transparent, `lossy ${level}: pixel ${i} transparency`);
+    }
+    if (level === 0) {
+      const expected = toRgba(indices, ramp);
+      for (let i = 0; i < indices.length; i++) {
+        if (indices[i] === transparent) expected.fill(0, i * 4, i * 4 + 4);
+      }
+      assertPixels(canvas, expected, "transparent frame");
+    }
+  }
+});
+
+test("rows streamed with addFrameRows decode like addFrame", () => {
+  const frame = toRgba(frameIndices(6));
+  const encoder = newEncoder();
+  const rowBytes = width * 4;
+  for (let y = 0; y < height; y += 10) {
+    const rows = frame.slice(y * rowBytes, Math.min(height, y + 10) * rowBytes);
+    assert.strictEqual(encoder.addFrameRows(rows), y + 10 >= height);
+  }
+  const streamed = encoder.finish();
+
+  const whole = newEncoder();
+  whole.addFrame(frame);
+  assert.ok(streamed.equals(whole.finish()), "streamed GIF differs from addFrame's");
+  assertPixels(decode(streamed)[0], frame, "streamed frame");
+});
+
+test("regions change only their rect", () => {
+  const encoder = newEncoder();
+  const first = toRgba(frameIndices(0));
+  encoder.addFrame(first);
+
+  const rect = { x: 8, y: 6, w: 20, h: 14 };
+  const patch = toRgba(frameIndices(7).slice(0, rect.w * rect.h));
+  encoder.addFrameRegion(patch, rect);
+  // the same rect read out of a whole frame by addFrame
+  const whole = toRgba(frameIndices(1));
+  encoder.addFrame(whole, { x: 30, y: 20, w: 16, h: 12 });
+  const canvases = decode(encoder.finish());
+
+  const expected = Buffer.from(first);
+  for (let y = 0; y < rect.h; y++) {
+    patch.copy(expected, ((rect.y + y) * width + rect.x) * 4, y * rect.w * 4, (y + 1) * rect.w * 4);
+  }
+  assertPixels(canvases[1], expected, "region frame");
+  for (let y = 20; y < 32; y++) {
+    whole.copy(expected, (y * width + 30) * 4, (y * width + 30) * 4, (y * width + 46) * 4);
+  }
+  assertPixels(canvases[2], expected, "addFrame rect");
+});
+
+test("append continues an existing GIF", () => {
+  const frames = [0, 1, 2].map((f) => toRgba(frameIndices(f)));
+  const encoder = newEncoder();
+  encoder.addFrame(frames[0]);
+  encoder.addFrame(frames[1]);
+  const gif = encoder.finish();
+
+  // a fixed palette can't continue a GIF, indexed frames bring their own
+  const appender = new GIFEncoder(width, height);
+  appender.append(gif);
+  appender.addIndexedFrame(frameIndices(2), palette);
+  const canvases = decode(appender.finish());
+  assert.strictEqual(canvases.length, 3);
+  canvases.forEach((canvas, f) => assertPixels(canvas, frames[f], `appended GIF frame ${f}`));
+});
+
+test("frame cache hits produce the same GIF", () => {
+  const frames = [0, 1, 0, 1].map((f) => toRgba(frameIndices(f)));
+  const encode = (cached) => {
+    const encoder = new GIFEncoder(width, height);
+    encoder.start();
+    encoder.setFrameCache(cached);
+    for (const frame of frames) encoder.addFrame(frame);
+    return encoder.finish();
+  };
+  const plain = encode(false);
+  const before = GIFEncoder.getFrameCacheStats().hits;
+  const cached = encode(true);
+  const again = encode(true);
+  assert.ok(GIFEncoder.getFrameCacheStats().hits >= before + frames.length, "frames were not served from the cache");
+  assert.ok(cached.equals(plain), "cached GIF differs from the uncached one");
+  assert.ok(again.equals(plain), "GIF from cache hits differs from the uncached one");
+});
+
+let failed = 0;
+for (const { name, fn } of cases) {
+  try {
+    fn();
+    console.log(`ok ${name}`);
+  } catch (err) {
+    failed++;
+    console.log(`FAIL ${name}\n  ${err.message}`);
+  }
+}
+console.log(failed === 0 ? `${cases.length} passed` : `${failed} of ${cases.length} failed`);
+process.exit(failed === 0 ? 0 : 1);
+
+function findAddon(explicit) {
+  const candidates = explicit
+    ? [path.resolve(explicit)]
+    : [path.join(__dirname, "../build/Release/addon.node"), path.join(__dirname, "../build/Debug/addon.node")];
+  const found = candidates.find((c) => fs.existsSync(c));
+  if (!found) throw new Error(`addon not found, build it first (tried ${candidates.join(", ")})`);
+  return found;
+}